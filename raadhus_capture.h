@@ -0,0 +1,45 @@
+#ifndef _RAADHUS_CAPTURE_H_
+#define _RAADHUS_CAPTURE_H_
+
+#include <stdint.h>
+
+/*
+  Frames received by raadhus_daemon can be recorded into a capture file
+  and played back later without the producer, see 'raadhus_daemon -r' and
+  '-p'. All fields are in network byte order, like raadhus_proto.h.
+
+  The file starts with a raadhus_capture_header, followed by a record for
+  each frame. When recording stops cleanly an index follows the records,
+  with the file offset of each record as two 32-bit halves, and the header
+  is updated with where it is. A file without one, e.g. after a crash,
+  can still be played back by walking the records.
+ */
+#define RAADHUS_CAPTURE_MAGIC 0x52444350	/* "RDCP" */
+#define RAADHUS_CAPTURE_VERSION 1
+
+struct raadhus_capture_header {
+	uint32_t magic;
+	uint32_t version;
+	/* Size of every frame in the file */
+	uint32_t frame_size;
+	/* Records in the index, 0 if there is none */
+	uint32_t frame_count;
+	uint32_t index_offset_high;
+	uint32_t index_offset_low;
+};
+
+/*
+  A record holds length bytes of a frame coded with the flags of
+  raadhus_proto.h: run-length coded, XORed onto the frame before, both or
+  neither. Records without RAADHUS_DELTA are keyframes
+ */
+struct raadhus_capture_record {
+	/* When the frame came in, from the start of the recording */
+	uint32_t sec;
+	uint32_t nsec;
+	uint32_t length;
+	uint16_t flags;
+	uint16_t reserved;
+};
+
+#endif	/* _RAADHUS_CAPTURE_H_ */
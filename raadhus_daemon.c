@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdio.h>
@@ -8,86 +11,509 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include "raadhus_proto.h"
+#include "raadhus_capture.h"
+#include "raadhus_ytkj.h"
 
 #define FPS 20
 #define LISTEN_PORT 1234
 #define MC_GROUP "224.1.1.1"
+#define MC_PORT 1097
+/* Metrics are served on this port of localhost, set with -m */
+#define STATS_PORT 1235
+
+/* Address of the interface the LEDs are on, set with -i */
+static struct in_addr mc_interface;
+
+/* Time between frames to the LEDs, set with -f */
+static long frame_period_ns = 1000000000L / FPS;
+
+/* Set by SIGUSR1 to have led_thread print its statistics */
+static volatile sig_atomic_t dump_stats;
 
-static pthread_mutex_t screen_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t screen_cond = PTHREAD_COND_INITIALIZER;
+/* Set by SIGHUP to have the color correction read again */
+static volatile sig_atomic_t reload_colors;
 
-/* We always start with 1 output buffer (which is clearing the screen) */
-static int ring_buffer_head = 1;
-static int ring_buffer_tail = -1;
+/* Set by SIGINT and SIGTERM to finish the capture file before quitting */
+static volatile sig_atomic_t stop;
 
 static const int MAX_PAYLOAD_SIZE = 1472;
+/* Must be a power of 2 */
 #define RING_BUFFER_SIZE 32
-#define NUMBER_OF_PIXELS_ON_STRIP 57
-#define NUMBER_OF_STRIPS_ON_PORT 4
-#define NUMBER_OF_LEDS_ON_PORT (NUMBER_OF_PIXELS_ON_STRIP * NUMBER_OF_STRIPS_ON_PORT * 3)
-#define PORTS_IN_USE 8
 
-/* 32 is a nice number. Even though we have a mix of 28 and 24 we just go for 32 */
-#define SEGMENT_SIZE 32
-#define NUMBER_OF_SEGMENTS 2
-#define XRES 56
-#define SEGMENT_SIZE_BYTES (NUMBER_OF_PIXELS_ON_STRIP * 3 * SEGMENT_SIZE)
+/*
+  How the LEDs are wired up is read from a layout file at startup, see
+  raadhus.layout. Each controller drives up to 8 ports and each port a
+  number of daisy-chained strips, one for each column of the wall.
+ */
+#define PORTS_PER_CONTROLLER 8
+#define MAX_STRIPS_ON_PORT 8
+#define MAX_CONTROLLERS 32
+#define CHANNELS_PER_PORT 2048
+
+enum strip_order {
+	/* Every other row from the bottom up, then the rest back down */
+	STRIP_UPDOWN,
+	/* The same, but wired from the other end */
+	STRIP_DOWNUP,
+	STRIP_UP,
+	STRIP_DOWN
+};
+
+static const char *strip_orders[] = { "updown", "downup", "up", "down" };
+
+struct strip {
+	/* Column of the frame, or -1 if nothing should be shown */
+	int column;
+	int pixels;
+	enum strip_order order;
+};
+
+struct port {
+	int strip_count;
+	struct strip strips[MAX_STRIPS_ON_PORT];
+};
+
+/*
+  Color correction of the LEDs of a controller: a gamma curve, a cap on the
+  brightness and a white balance, both in percent
+ */
+struct color {
+	double gamma;
+	int brightness;
+	int balance[3];
+};
+
+struct controller {
+	int id;
+	int port_count;
+	struct port ports[PORTS_PER_CONTROLLER];
+	struct color color;
+};
+
+/*
+  How the frames of the clients at an address, or at an address and port,
+  are layered, see composite(). Clients without one get priority 0, a
+  timeout of DEFAULT_SOURCE_TIMEOUT_MS and cover those below them
+ */
+#define MAX_SOURCE_RULES 16
+#define DEFAULT_SOURCE_TIMEOUT_MS 1000
+
+struct source_rule {
+	struct in_addr addr;
+	/* 0 for any port */
+	int port;
+	int priority;
+	int timeout_ms;
+	/* In percent */
+	int alpha;
+};
+
+struct layout {
+	/* A frame from a client is width x height RGB pixels */
+	int width, height;
+	int controller_count;
+	struct controller controllers[MAX_CONTROLLERS];
+	int rule_count;
+	struct source_rule rules[MAX_SOURCE_RULES];
+};
+
+static struct layout layout;
+static const char *layout_file = "raadhus.layout";
+
+/*
+  Channels in a frame, and its size in bytes. Wide frames (-w) have 16 bits
+  per channel, most significant byte first
+ */
+static int frame_samples, frame_size;
+static int wide_frames;
+
+/*
+  Frames are followed by a black pixel, which is what LEDs outside the
+  frame show. Room for one of a wide frame
+ */
+#define FRAME_PADDING 6
+
+static int port_bytes(const struct port *port)
+{
+	int i, bytes = 0;
+	for (i = 0; i < port->strip_count; i++) {
+		bytes += port->strips[i].pixels * 3;
+	}
+	return bytes;
+}
+
+static int controller_bytes(const struct controller *controller)
+{
+	int i, bytes = 0;
+	for (i = 0; i < controller->port_count; i++) {
+		bytes += port_bytes(&controller->ports[i]);
+	}
+	return bytes;
+}
+
+static int parse_int(const char *word, int min, int max)
+{
+	char *end;
+	long value;
+
+	if (!word) {
+		return min - 1;
+	}
+	value = strtol(word, &end, 10);
+	if (*end || value < min || value > max) {
+		return min - 1;
+	}
+	return value;
+}
+
+/*
+  Reads the layout. The format is line based, with # starting a comment:
+
+  frame <width> <height>
+  strip <pixels> <order>       pixels and order of the strips on the ports
+                               below it, order is updown, downup, up or down
+  controller <id>
+  port <column> [<column>...]  the next port of the controller, with the
+                               column of each strip on it, or - for none
+  source <address>[:<port>] <priority> [<timeout ms> [<alpha %>]]
+ */
+static int read_layout(const char *filename, struct layout *layout)
+{
+	FILE *fd = fopen(filename, "r");
+	char line[256];
+	int lineno = 0, ret = 0;
+	struct strip strip = { -1, 0, STRIP_UPDOWN };
+	struct color color = { 1.0, 100, { 100, 100, 100 } };
+	struct controller *controller = NULL;
+
+	if (!fd) {
+		perror(filename);
+		return -1;
+	}
+
+	memset(layout, 0, sizeof(*layout));
+
+	while (fgets(line, sizeof(line), fd)) {
+		char *word, *comment = strchr(line, '#');
+		const char *error = NULL;
+
+		lineno++;
+		if (comment) {
+			*comment = 0;
+		}
+		if (!(word = strtok(line, " \t\r\n"))) {
+			continue;
+		}
+
+		if (!strcmp(word, "frame")) {
+			layout->width = parse_int(strtok(NULL, " \t\r\n"), 1, 65535);
+			layout->height = parse_int(strtok(NULL, " \t\r\n"), 1, 65535);
+			strip.pixels = layout->height;
+			if (layout->width <= 0 || layout->height <= 0) {
+				error = "invalid frame size";
+			}
+		} else if (!strcmp(word, "strip")) {
+			const char *order;
+			strip.pixels = parse_int(strtok(NULL, " \t\r\n"), 1,
+						 CHANNELS_PER_PORT / 3);
+			order = strtok(NULL, " \t\r\n");
+			for (strip.order = STRIP_UPDOWN; strip.order <= STRIP_DOWN;
+			     strip.order++) {
+				if (order && !strcmp(order, strip_orders[strip.order])) {
+					break;
+				}
+			}
+			if (strip.pixels <= 0) {
+				error = "invalid number of pixels on strip";
+			} else if (strip.order > STRIP_DOWN) {
+				error = "unknown strip order";
+			}
+		} else if (!strcmp(word, "gamma")) {
+			const char *value = strtok(NULL, " \t\r\n");
+			char *end;
+			color.gamma = value ? strtod(value, &end) : 0;
+			if (!value || *end || color.gamma < 0.1 || color.gamma > 10) {
+				error = "invalid gamma";
+			}
+		} else if (!strcmp(word, "brightness")) {
+			if ((color.brightness = parse_int(strtok(NULL, " \t\r\n"),
+							  0, 100)) < 0) {
+				error = "invalid brightness";
+			}
+		} else if (!strcmp(word, "balance")) {
+			int i;
+			for (i = 0; i < 3 && !error; i++) {
+				if ((color.balance[i] = parse_int(strtok(NULL, " \t\r\n"),
+								  0, 100)) < 0) {
+					error = "invalid white balance";
+				}
+			}
+		} else if (!strcmp(word, "controller")) {
+			if (layout->controller_count == MAX_CONTROLLERS) {
+				error = "too many controllers";
+			} else {
+				controller = &layout->controllers[layout->controller_count++];
+				controller->color = color;
+				if ((controller->id = parse_int(strtok(NULL, " \t\r\n"),
+								1, 255)) <= 0) {
+					error = "invalid controller id";
+				}
+			}
+		} else if (!strcmp(word, "port")) {
+			struct port *port;
+			if (!controller) {
+				error = "port before controller";
+			} else if (!strip.pixels) {
+				error = "port before frame or strip";
+			} else if (controller->port_count == PORTS_PER_CONTROLLER) {
+				error = "too many ports on controller";
+			} else {
+				port = &controller->ports[controller->port_count++];
+				while (!error && (word = strtok(NULL, " \t\r\n"))) {
+					if (port->strip_count == MAX_STRIPS_ON_PORT) {
+						error = "too many strips on port";
+						break;
+					}
+					strip.column = strcmp(word, "-") ?
+						parse_int(word, 0, 65535) : -1;
+					if (strip.column < -1) {
+						error = "invalid column";
+					}
+					port->strips[port->strip_count++] = strip;
+				}
+				if (!error && !port->strip_count) {
+					error = "no strips on port";
+				} else if (!error && port_bytes(port) > CHANNELS_PER_PORT) {
+					error = "too many LEDs on port";
+				}
+			}
+		} else if (!strcmp(word, "source")) {
+			struct source_rule rule;
+			char *address = strtok(NULL, " \t\r\n"), *port = NULL;
+			const char *value;
+
+			memset(&rule, 0, sizeof(rule));
+			rule.timeout_ms = DEFAULT_SOURCE_TIMEOUT_MS;
+			rule.alpha = 100;
+			if (address && (port = strchr(address, ':'))) {
+				*port++ = 0;
+				rule.port = parse_int(port, 1, 65535);
+			}
+			rule.priority = parse_int(strtok(NULL, " \t\r\n"), -1000, 1000);
+			if ((value = strtok(NULL, " \t\r\n"))) {
+				rule.timeout_ms = parse_int(value, 1, 3600000);
+			}
+			if ((value = strtok(NULL, " \t\r\n"))) {
+				rule.alpha = parse_int(value, 0, 100);
+			}
+			if (layout->rule_count == MAX_SOURCE_RULES) {
+				error = "too many sources";
+			} else if (!address || !inet_aton(address, &rule.addr) ||
+				   (port && !rule.port)) {
+				error = "invalid source address";
+			} else if (rule.priority < -1000 || !rule.timeout_ms || rule.alpha < 0) {
+				error = "invalid source priority, timeout or alpha";
+			} else {
+				layout->rules[layout->rule_count++] = rule;
+			}
+		} else {
+			error = "unknown keyword";
+		}
+
+		if (error) {
+			fprintf(stderr, "%s:%d: %s\n", filename, lineno, error);
+			ret = -1;
+		}
+	}
+
+	fclose(fd);
+
+	if (!ret && !layout->width) {
+		fprintf(stderr, "%s: no frame size\n", filename);
+		ret = -1;
+	} else if (!ret && !layout->controller_count) {
+		fprintf(stderr, "%s: no controllers\n", filename);
+		ret = -1;
+	}
+	if (!ret && (long)layout->width * layout->height * 3 + FRAME_PADDING > 65536) {
+		/* The lookup tables hold 16 bit offsets */
+		fprintf(stderr, "%s: frame is too large\n", filename);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+  Flags columns of the layout which are used more than once, which are
+  outside the frame, and columns of the frame no strip shows. Returns the
+  number of problems found.
+ */
+static int check_layout(void)
+{
+	unsigned char *uses = calloc(layout.width, 1);
+	int c, p, s, problems = 0;
+
+	for (c = 0; c < layout.controller_count; c++) {
+		const struct controller *controller = &layout.controllers[c];
+		for (p = 0; p < controller->port_count; p++) {
+			const struct port *port = &controller->ports[p];
+			for (s = 0; s < port->strip_count; s++) {
+				int column = port->strips[s].column;
+				if (column >= layout.width) {
+					fprintf(stderr, "controller %d port %d strip %d: column %d "
+						"is outside the frame\n",
+						controller->id, p + 1, s + 1, column);
+					problems++;
+				} else if (column >= 0 && uses[column]++) {
+					fprintf(stderr, "controller %d port %d strip %d: column %d "
+						"is already mapped\n",
+						controller->id, p + 1, s + 1, column);
+					problems++;
+				}
+			}
+		}
+	}
+
+	for (c = 0; c < layout.width; c++) {
+		if (!uses[c]) {
+			fprintf(stderr, "column %d is not mapped\n", c);
+			problems++;
+		}
+	}
+
+	free(uses);
+	return problems;
+}
+
+/* Row of the frame shown by LED i of a strip, or -1 if there is none */
+static int strip_row(const struct strip *strip, int i)
+{
+	int height = layout.height, up = (height + 1) / 2;
+
+	if (strip->column < 0 || strip->column >= layout.width || i >= height) {
+		return -1;
+	}
 
-static unsigned char *screens[RING_BUFFER_SIZE][NUMBER_OF_SEGMENTS];
+	switch (strip->order) {
+	case STRIP_UP:
+		return i;
+	case STRIP_DOWN:
+		return height - 1 - i;
+	case STRIP_DOWNUP:
+		i = height - 1 - i;
+		/* fall through */
+	case STRIP_UPDOWN:
+	default:
+		/* Run from bottom to top of strip, then from top to bottom */
+		if (i < up) {
+			return i * 2;
+		}
+		return height - 1 - height % 2 - (i - up) * 2;
+	}
+}
 
 static void map_pixel(int ix, int iy, const unsigned char *in,
 		      unsigned char *out)
 {
-	const unsigned char *p = &in[(ix + iy * XRES) * 3];
+	const unsigned char *p = iy < 0 ? &in[frame_samples] : &in[(ix + iy * layout.width) * 3];
 	out[0] = p[0];
 	out[1] = p[1];
 	out[2] = p[2];
 }
 
-static const unsigned char seg_maps[NUMBER_OF_SEGMENTS][SEGMENT_SIZE] =
-{{12, 13, 14, 15, 16, 17, 18, 19,
-  20, 21, 22, 23, 24, 25, 26, 27,
-  28, 29, 30, 31, 32, 33, 34, 35,
-  36, 37, 38, 39, 40, 41, 42, 42},
- {0, 1, 2, 3, 4, 5, 6, 7,
-  8, 9, 10, 11, 40, 41, 42, 43,
-  44, 45, 46, 47, 48, 49, 50, 51,
-  52, 53, 54, 55, 56, 57, 58, 59}
-};
+/*
+  Reference mapping which walks the layout for every frame. The daemon uses
+  the lookup tables of the packets instead, but this is kept for the
+  benchmark (-b) to compare with
+ */
+static void map_controller(const unsigned char *in, const struct controller *controller,
+			   unsigned char *out)
+{
+	int p, s, i;
+	for (p = 0; p < controller->port_count; p++) {
+		const struct port *port = &controller->ports[p];
+		for (s = 0; s < port->strip_count; s++) {
+			const struct strip *strip = &port->strips[s];
+			for (i = 0; i < strip->pixels; i++) {
+				map_pixel(strip->column, strip_row(strip, i), in, out);
+				out += 3;
+			}
+		}
+	}
+}
 
 static void map_pixels(const unsigned char *in, unsigned char *segments[])
 {
-	int i, ix, segment;
-	for(segment = 0; segment < NUMBER_OF_SEGMENTS; segment++) {
-		unsigned char *out = segments[segment];
-		for (ix = 0; ix < SEGMENT_SIZE;) {
-			for (i = 0; i < NUMBER_OF_STRIPS_ON_PORT; i++) {
-				int ix_mapped = seg_maps[segment][ix];
-				int iy;
-				/* Run from bottom to top of strip */
-				for (iy = 0; iy < NUMBER_OF_PIXELS_ON_STRIP; iy += 2) {
-					map_pixel(ix_mapped, iy, in, out);
-					out += 3;
-				}
-				/* Run from top to bottom of strip */
-				for (iy = NUMBER_OF_PIXELS_ON_STRIP - 2; iy >= 0;
-				     iy -= 2) {
-					map_pixel(ix_mapped, iy, in, out);
-					out += 3;
-				}
-				ix++;
+	int c;
+	for (c = 0; c < layout.controller_count; c++) {
+		map_controller(in, &layout.controllers[c], segments[c]);
+	}
+}
+
+/*
+  Builds the gather table of a controller holding, for each output byte, the
+  offset of the byte in the received frame it should be copied from. It is
+  built once at startup so the per-frame work is a plain table driven copy
+ */
+static unsigned short *build_remap_lut(const struct controller *controller)
+{
+	unsigned short *lut = malloc(controller_bytes(controller) * sizeof(*lut));
+	unsigned short *out = lut;
+	int p, s, i;
+
+	for (p = 0; p < controller->port_count; p++) {
+		const struct port *port = &controller->ports[p];
+		for (s = 0; s < port->strip_count; s++) {
+			const struct strip *strip = &port->strips[s];
+			for (i = 0; i < strip->pixels; i++) {
+				int iy = strip_row(strip, i);
+				int offset = iy < 0 ? frame_samples :
+					(strip->column + iy * layout.width) * 3;
+				out[0] = offset;
+				out[1] = offset + 1;
+				out[2] = offset + 2;
+				out += 3;
 			}
 		}
 	}
+
+	return lut;
 }
 
+/* A run of LED data at offset in a payload */
+struct payload_span {
+	unsigned short offset;
+	unsigned short length;
+};
+
 /*
-  Maps a buffer to a payload and returns the number of bytes put into the payload
+  Maps a buffer to a payload and returns the number of bytes put into the payload.
+  Note that the dummy UDP headers are not counted, so the last bytes written
+  are never sent.
+
+  If spans is given the runs of LED data are stored in it and span_count is
+  set. screen may be NULL, in which case only the headers are written.
  */
-static int payload_buffer(const unsigned char *screen, unsigned char *payload, int controller)
+static int payload_buffer(const unsigned char *screen, unsigned char *payload,
+			  const struct controller *controller,
+			  struct payload_span *spans, int *span_count)
 {
 	int channelOffset = 0, ledMTUCarry = 0, byteCount = 0;
-	int count = 0;
+	int count = 0, port = 0;
+	int total = controller_bytes(controller);
+	const unsigned char *payload_start = payload;
+
+	if (span_count) {
+		*span_count = 0;
+	}
 
 	do {
 		int payloadIndex = 0;
@@ -107,7 +533,7 @@ static int payload_buffer(const unsigned char *screen, unsigned char *payload, i
 		payload[payloadIndex + 2] = 'K';
 		payload[payloadIndex + 3] = 'J';
 
-		payload[payloadIndex + 4] = controller;
+		payload[payloadIndex + 4] = controller->id;
 		payload[payloadIndex + 5] = 0;
 
 		/* Unknown */
@@ -131,9 +557,10 @@ static int payload_buffer(const unsigned char *screen, unsigned char *payload, i
 			if (ledMTUCarry) {
 				ledsOnPort = ledMTUCarry;
 			} else {
-				ledsOnPort = NUMBER_OF_LEDS_ON_PORT;
+				ledsOnPort = port_bytes(&controller->ports[port]);
 			}
-			if (ledsOnPort > bytesLeft) {
+			/* The length of the entry takes 2 of them */
+			if (ledsOnPort > bytesLeft - 2) {
 				/* Data cannot fit into one "MTU", we need to split it */
 				ledMTUCarry = ledsOnPort - (bytesLeft - 2);
 				ledsOnPort = bytesLeft - 2;
@@ -145,146 +572,2606 @@ static int payload_buffer(const unsigned char *screen, unsigned char *payload, i
 				channelOffset &= ~(2047);
 				channelOffset += 2048;
 				ledMTUCarry = 0;
+				port++;
 			}
 
 			(*portCounter)++;
 			payload[payloadIndex++] = (ledsOnPort & 0xff);
 			payload[payloadIndex++] = ((ledsOnPort >> 8) & 0xff);
 
+			if (spans) {
+				spans[*span_count].offset = payload - payload_start + payloadIndex;
+				spans[*span_count].length = ledsOnPort;
+				(*span_count)++;
+			}
+			if (!screen) {
+				payloadIndex += ledsOnPort;
+				count += ledsOnPort;
+				ledsOnPort = 0;
+			}
 			for (; ledsOnPort > 0; ledsOnPort--) {
 				payload[payloadIndex] = *screen;
 				screen++;
 				payloadIndex++;
 				count++;
 			}
-		} while (payloadIndex < MAX_PAYLOAD_SIZE
-			 && count < NUMBER_OF_LEDS_ON_PORT * PORTS_IN_USE);
+			/* Another port needs room for its entry and a byte */
+		} while (payloadIndex + 4 < MAX_PAYLOAD_SIZE && count < total);
 		payload += payloadIndex;
 		byteCount += payloadIndex;
-	} while (count < NUMBER_OF_LEDS_ON_PORT * PORTS_IN_USE);
+	} while (count < total);
 
 	return byteCount;
 }
 
-static void *led_thread(void *data)
+/*
+  Upper bounds for payload_buffer(). Every chunk but the last is full, so
+  there cannot be more than one split port per 1024 bytes of LEDs
+ */
+static int max_spans(const struct controller *controller)
 {
-	int sockd;
-	unsigned char *payload;
+	return controller->port_count + controller_bytes(controller) / 1024 + 2;
+}
 
-	struct sockaddr_in my_addr;
+static int max_payload_size(const struct controller *controller)
+{
+	/* Each span can start a chunk with 8 + 10 + 4 bytes of headers */
+	return controller_bytes(controller) + max_spans(controller) * 22;
+}
 
-	/* Allocate plenty */
-	payload = malloc(15000);
+/*
+  Color correction is done through a table for each controller with the
+  256 values of each channel, looked up while gathering the frame so it
+  costs no extra pass over it.
 
-	sockd = socket(AF_INET, SOCK_DGRAM, 0);
+  The tables are replaced when SIGHUP has the layout file read again. The
+  new ones are built in the buffer not in use and swapped in with a single
+  pointer, so a frame is never sent with a mix of the two. led_thread
+  announces the tables it is using in in_use, so they are not rebuilt
+  under it.
+ */
+#define WIDE_BITS 12
 
-	if (sockd == -1) {
-		perror("Socket creation error");
-		return 0;
+struct color_table {
+	unsigned char narrow[3][256];
+	/*
+	  For wide frames, looked up with the top 12 bits of a channel. It holds
+	  the LED value times 256, keeping the fraction for dithering
+	 */
+	unsigned short wide[3][1 << WIDE_BITS];
+};
+
+static struct {
+	struct color_table *buffers[2];
+	struct color_table *current;
+	struct color_table *in_use;
+} colors;
+
+/* Only built when needed, since pow() is slow on the router */
+static int wide_tables;
+
+static void build_color_table(const struct color *color, struct color_table *table)
+{
+	int c, v;
+
+	for (c = 0; c < 3; c++) {
+		double scale = 255.0 * color->brightness / 100 * color->balance[c] / 100;
+		for (v = 0; v < 256; v++) {
+			table->narrow[c][v] = pow(v / 255.0, color->gamma) * scale + 0.5;
+		}
+		for (v = 0; wide_tables && v < 1 << WIDE_BITS; v++) {
+			table->wide[c][v] = pow(v / (double)((1 << WIDE_BITS) - 1),
+						color->gamma) * scale * 256 + 0.5;
+		}
 	}
+}
 
-	/* Bind the socket to anything */
-	my_addr.sin_family = AF_INET;
-	my_addr.sin_addr.s_addr = INADDR_ANY;
-	my_addr.sin_port = htons(0);
+/* Builds the tables for the controllers of the layout and swaps them in */
+static void set_colors(const struct layout *layout)
+{
+	struct color_table *next = colors.current == colors.buffers[0] ?
+		colors.buffers[1] : colors.buffers[0];
+	int c;
 
-	if (bind(sockd, (struct sockaddr *)&my_addr, sizeof(my_addr)) < 0) {
-		perror("failed to bind socket");
+	while (__atomic_load_n(&colors.in_use, __ATOMIC_SEQ_CST) == next) {
+		sched_yield();
 	}
+	for (c = 0; c < layout->controller_count; c++) {
+		build_color_table(&layout->controllers[c].color, &next[c]);
+	}
+	__atomic_store_n(&colors.current, next, __ATOMIC_SEQ_CST);
+}
 
-	while (1) {
-		int next_buffer, segment;
-		pthread_mutex_lock(&screen_mutex);
-		while ((next_buffer =
-			(ring_buffer_tail + 1) % RING_BUFFER_SIZE) ==
-		       ring_buffer_head) {
-			pthread_cond_wait(&screen_cond, &screen_mutex);
-		}
-		ring_buffer_tail = next_buffer;
-
-		for(segment = 0; segment < NUMBER_OF_SEGMENTS; segment++) {
-			int bytes_mapped =
-				payload_buffer(screens[ring_buffer_tail][segment], payload, segment + 1);
-			
-			struct sockaddr_in dest;
-			
-			dest.sin_family = AF_INET;
-			dest.sin_addr.s_addr = inet_addr(MC_GROUP);
-			dest.sin_port = htons(1097);
-			
-			if (sendto
-			    (sockd, payload, bytes_mapped, 0, (struct sockaddr *)&dest,
-			     sizeof(dest)) < 0) {
-				/* we don't really care */
-				perror("failed");
-			}
-		}
-		pthread_mutex_unlock(&screen_mutex);
-		usleep(1000 * 1000 / FPS);
+/* Gets the tables to send a frame with, until colors_release() */
+static struct color_table *colors_acquire(void)
+{
+	struct color_table *tables;
+
+	/* If they were swapped before we announced them, they may be rebuilt */
+	do {
+		tables = __atomic_load_n(&colors.current, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&colors.in_use, tables, __ATOMIC_SEQ_CST);
+	} while (tables != __atomic_load_n(&colors.current, __ATOMIC_SEQ_CST));
+
+	return tables;
+}
+
+static void colors_release(void)
+{
+	__atomic_store_n(&colors.in_use, NULL, __ATOMIC_SEQ_CST);
+}
+
+/*
+  A packet for one controller. The headers are written once by
+  build_packets() and each frame is gathered straight into the spans of LED
+  data through lut
+ */
+static struct packet {
+	unsigned char *payload;
+	int size;
+	const unsigned short *lut;
+	struct payload_span *spans;
+	int span_count;
+	/* Bytes of LED data in the spans */
+	int length;
+	/* Wide frames are gathered here, and the error kept for dithering */
+	unsigned short *wide;
+	unsigned char *error;
+	struct iovec iov;
+} *packets;
+
+#ifndef NO_SENDMMSG
+/* All the packets for sendmmsg() */
+static struct mmsghdr *messages;
+#endif
+
+static void build_packet(struct packet *packet, const struct controller *controller)
+{
+	int i;
+
+	packet->payload = malloc(max_payload_size(controller));
+	packet->spans = malloc(max_spans(controller) * sizeof(*packet->spans));
+	packet->size = payload_buffer(NULL, packet->payload, controller,
+				      packet->spans, &packet->span_count);
+	packet->lut = build_remap_lut(controller);
+
+	packet->iov.iov_base = packet->payload;
+	packet->iov.iov_len = packet->size;
+
+	/* No need to gather what is never sent */
+	for (i = 0; i < packet->span_count; i++) {
+		struct payload_span *span = &packet->spans[i];
+		if (span->offset >= packet->size) {
+			span->length = 0;
+		} else if (span->offset + span->length > packet->size) {
+			span->length = packet->size - span->offset;
+		}
+		packet->length += span->length;
 	}
+	packet->wide = malloc(packet->length * sizeof(*packet->wide));
+	packet->error = calloc(packet->length, 1);
+}
 
-	return 0;
+static void build_packets(void)
+{
+	int c;
+
+	packets = calloc(layout.controller_count, sizeof(*packets));
+#ifndef NO_SENDMMSG
+	messages = calloc(layout.controller_count, sizeof(*messages));
+#endif
+	for (c = 0; c < layout.controller_count; c++) {
+		build_packet(&packets[c], &layout.controllers[c]);
+#ifndef NO_SENDMMSG
+		messages[c].msg_hdr.msg_iov = &packets[c].iov;
+		messages[c].msg_hdr.msg_iovlen = 1;
+#endif
+	}
+
+	colors.buffers[0] = malloc(layout.controller_count * sizeof(struct color_table));
+	colors.buffers[1] = malloc(layout.controller_count * sizeof(struct color_table));
+	set_colors(&layout);
 }
 
-int main(int argc, char *argv[])
+/*
+  Gathers a frame into a packet through the color table of the controller.
+  The LEDs take their bytes in RGB order like the frame, and a port split
+  across chunks can end in the middle of an LED, so the channel just rolls
+  over from one span to the next
+ */
+static void gather_packet(const unsigned char *frame, struct packet *packet,
+			  const unsigned char *color)
 {
-	/* Buffer used to hold data from clients and the "screen" which is a mapping of the pixels
-	   that fits how the LEDs should receive them */
-	unsigned char *buffer;
-	pthread_t tid;
-	/* We need to hold xres * yres * 3, but just allocate plenty */
-	const int buffer_size = 15000;
-	struct sockaddr_in my_addr, client_addr;
-	socklen_t addrlen;
-	ssize_t bread;
-	int sockd;
+	const unsigned short *lut = packet->lut;
+	const unsigned char *red = color, *green = color + 256, *blue = color + 512;
+	int i;
 
-	/* malloc the receiving buffer */
-	buffer = malloc(buffer_size);
-	/* malloc all the temporary screens */
-	{
-		int i, j;
-		for(i = 0; i < RING_BUFFER_SIZE; i++) {
-			for(j = 0; j < NUMBER_OF_SEGMENTS; j++) {
-				screens[i][j] = calloc(1, SEGMENT_SIZE_BYTES);
-			}
+	for (i = 0; i < packet->span_count; i++) {
+		unsigned char *out = packet->payload + packet->spans[i].offset;
+		unsigned char *end = out + packet->spans[i].length;
+		for (; end - out >= 3; out += 3, lut += 3) {
+			out[0] = red[frame[lut[0]]];
+			out[1] = green[frame[lut[1]]];
+			out[2] = blue[frame[lut[2]]];
+		}
+		while (out < end) {
+			const unsigned char *next = red;
+			*out++ = red[frame[*lut++]];
+			red = green;
+			green = blue;
+			blue = next;
 		}
 	}
+}
 
-	sockd = socket(AF_INET, SOCK_DGRAM, 0);
+/*
+  Temporal dithering for wide frames. Each LED byte keeps the fraction it
+  could not show and adds it to what it shows in the next frame, so over a
+  few frames it averages out to the full value. That gets rid of the
+  banding of dark gradients, which is worst with the brightness capped.
+  Values are at most 255 * 256 and the error below 256, so the sum always
+  fits in 16 bits. Kept to plain arrays so the compiler can vectorize it
+ */
+static void dither(const unsigned short *value, unsigned char *error,
+		   unsigned char *out, int length)
+{
+	int i;
 
-	if (sockd == -1) {
-		perror("Socket creation error");
-		return -2;
+	for (i = 0; i < length; i++) {
+		unsigned int sum = value[i] + error[i];
+		out[i] = sum >> 8;
+		error[i] = sum;
 	}
+}
 
-	/* Start LED thread */
-	pthread_create(&tid, NULL, led_thread, NULL);
-	pthread_detach(tid);
+/* The top bits of a channel of a wide frame */
+#define WIDE_SAMPLE(frame, offset) \
+	((frame)[2 * (offset)] << (WIDE_BITS - 8) | \
+	 (frame)[2 * (offset) + 1] >> (16 - WIDE_BITS))
 
-	/* Bind the socket to our listening port */
-	my_addr.sin_family = AF_INET;
-	my_addr.sin_addr.s_addr = INADDR_ANY;
-	my_addr.sin_port = htons(LISTEN_PORT);
+static void gather_wide_packet(const unsigned char *frame, struct packet *packet,
+			       const struct color_table *color)
+{
+	const unsigned short *lut = packet->lut;
+	const unsigned short *red = color->wide[0], *green = color->wide[1];
+	const unsigned short *blue = color->wide[2];
+	unsigned short *value = packet->wide;
+	unsigned char *error = packet->error;
+	int i;
 
-	bind(sockd, (struct sockaddr *)&my_addr, sizeof(my_addr));
+	for (i = 0; i < packet->length - 2; i += 3, lut += 3) {
+		/* Load all the offsets first, as value may alias them */
+		int r = lut[0], g = lut[1], b = lut[2];
+		value[i] = red[WIDE_SAMPLE(frame, r)];
+		value[i + 1] = green[WIDE_SAMPLE(frame, g)];
+		value[i + 2] = blue[WIDE_SAMPLE(frame, b)];
+	}
+	for (; i < packet->length; i++, lut++) {
+		value[i] = color->wide[i % 3][WIDE_SAMPLE(frame, *lut)];
+	}
+
+	for (i = 0; i < packet->span_count; i++) {
+		int length = packet->spans[i].length;
+		dither(value, error, packet->payload + packet->spans[i].offset, length);
+		value += length;
+		error += length;
+	}
+}
+
+/*
+  Ring of received frames between the receive loop (the producer) and
+  led_thread (the consumer). Frames are kept as is and only mapped when they
+  are sent.
+
+  The frames are passed around as slot numbers so nothing is copied: the
+  receive loop always owns one slot to receive into, led_thread owns the one
+  it is sending and the rest are either queued or free. The tail of the
+  queue is moved with a compare and swap since the receive loop takes the
+  oldest frame back itself when dropping it.
+ */
+enum drop_policy {
+	/* Throw away the received frame when the ring is full */
+	DROP_NEWEST,
+	/* Throw away the oldest queued frame when the ring is full */
+	DROP_OLDEST,
+	/* led_thread skips to the newest frame, whatever is queued */
+	LATEST_WINS
+};
+
+/* One for the producer and up to two for the consumer while it skips frames */
+#define RING_SLOTS (RING_BUFFER_SIZE + 3)
+/* Power of 2 that can hold all the slots */
+#define FREE_QUEUE_SIZE (RING_BUFFER_SIZE * 2)
+
+static struct {
+	unsigned char *slots[RING_SLOTS];
+	enum drop_policy policy;
+
+	/* Queued frames. head is only moved by the producer */
+	unsigned char queue[RING_BUFFER_SIZE];
+	unsigned int head, tail;
+
+	/* Slots handed back by the consumer */
+	unsigned char free[FREE_QUEUE_SIZE];
+	unsigned int free_head, free_tail;
+
+	int recv_slot;
+	int send_slot;
+
+	/* When the frame in each slot was queued */
+	struct timespec queued[RING_SLOTS];
+
+	unsigned int frames;
+	unsigned int drops;
+	unsigned int max_depth;
+} ring;
+
+static void ring_init(enum drop_policy policy)
+{
+	int i;
 
-	addrlen = sizeof(client_addr);
+	for (i = 0; i < RING_SLOTS; i++) {
+		free(ring.slots[i]);
+	}
+	memset(&ring, 0, sizeof(ring));
+	for (i = 0; i < RING_SLOTS; i++) {
+		ring.slots[i] = calloc(1, frame_size + FRAME_PADDING);
+	}
+	ring.policy = policy;
+
+	/* We always start with 1 output buffer (which is clearing the screen) */
+	ring.queue[0] = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ring.queued[0]);
+	ring.head = 1;
+	ring.recv_slot = 1;
+	ring.send_slot = -1;
+	for (i = 2; i < RING_SLOTS; i++) {
+		ring.free[ring.free_head++] = i;
+	}
+}
+
+static unsigned int ring_depth(void)
+{
+	return __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+}
 
-	while ((bread =
-		recvfrom(sockd, buffer, buffer_size, 0,
-			 (struct sockaddr *)&client_addr, &addrlen)) >= 0) {
-		addrlen = sizeof(client_addr);
-		pthread_mutex_lock(&screen_mutex);
-		/* Only use the received buffer if output to LEDs is up to speed */
-		if (ring_buffer_head != ring_buffer_tail) {
-			map_pixels(buffer, screens[ring_buffer_head]);
-			ring_buffer_head =
-			    (ring_buffer_head + 1) % RING_BUFFER_SIZE;
-			pthread_cond_broadcast(&screen_cond);
+/* Takes the oldest frame off the queue, or returns -1 if it is empty */
+static int ring_take(void)
+{
+	unsigned int tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+
+	/* A failed compare and swap reloads tail */
+	while (tail != __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE)) {
+		int slot = __atomic_load_n(&ring.queue[tail % RING_BUFFER_SIZE],
+					   __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&ring.tail, &tail, tail + 1, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			return slot;
 		}
-		pthread_mutex_unlock(&screen_mutex);
 	}
 
+	return -1;
+}
+
+/* The frame the producer should receive into */
+static unsigned char *ring_recv_frame(void)
+{
+	return ring.slots[ring.recv_slot];
+}
+
+/*
+  Queues the frame just received into ring_recv_frame(). Returns 0 if the
+  frame was queued, or -1 if it was dropped and ring_recv_frame() can be
+  reused
+ */
+static int ring_push(void)
+{
+	unsigned int head = ring.head, depth;
+	unsigned int tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+	int slot = -1;
+
+	__atomic_add_fetch(&ring.frames, 1, __ATOMIC_RELAXED);
+	if (head - tail >= RING_BUFFER_SIZE) {
+		if (ring.policy == DROP_NEWEST) {
+			__atomic_add_fetch(&ring.drops, 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+		/* If led_thread takes it first there is room anyway */
+		slot = __atomic_load_n(&ring.queue[tail % RING_BUFFER_SIZE],
+				       __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&ring.tail, &tail, tail + 1, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_add_fetch(&ring.drops, 1, __ATOMIC_RELAXED);
+		} else {
+			slot = -1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ring.queued[ring.recv_slot]);
+	__atomic_store_n(&ring.queue[head % RING_BUFFER_SIZE], ring.recv_slot,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+
+	/* The queue had room, so there is always a free slot */
+	if (slot < 0) {
+		unsigned int free_tail = ring.free_tail;
+		slot = ring.free[free_tail % FREE_QUEUE_SIZE];
+		__atomic_store_n(&ring.free_tail, free_tail + 1, __ATOMIC_RELEASE);
+	}
+	ring.recv_slot = slot;
+
+	depth = ring_depth();
+	if (depth > ring.max_depth) {
+		ring.max_depth = depth;
+	}
+
+	return 0;
+}
+
+/* Hands the frame from the last ring_pop() back to the producer */
+static void ring_release(void)
+{
+	if (ring.send_slot >= 0) {
+		unsigned int free_head = ring.free_head;
+		ring.free[free_head % FREE_QUEUE_SIZE] = ring.send_slot;
+		__atomic_store_n(&ring.free_head, free_head + 1, __ATOMIC_RELEASE);
+		ring.send_slot = -1;
+	}
+}
+
+/*
+  Gets the next frame for the consumer, or NULL if there is none. The frame
+  is owned by the consumer until the next call.
+ */
+static const unsigned char *ring_pop(void)
+{
+	int slot;
+
+	ring_release();
+	if ((slot = ring_take()) < 0) {
+		return NULL;
+	}
+
+	if (ring.policy == LATEST_WINS) {
+		int newer;
+		while ((newer = ring_take()) >= 0) {
+			ring.send_slot = slot;
+			ring_release();
+			__atomic_add_fetch(&ring.drops, 1, __ATOMIC_RELAXED);
+			slot = newer;
+		}
+	}
+
+	ring.send_slot = slot;
+	return ring.slots[slot];
+}
+
+/* When the frame from the last ring_pop() was queued */
+static const struct timespec *ring_queued(void)
+{
+	return &ring.queued[ring.send_slot];
+}
+
+static void timespec_add_ns(struct timespec *t, long ns)
+{
+	t->tv_nsec += ns;
+	while (t->tv_nsec >= 1000000000L) {
+		t->tv_nsec -= 1000000000L;
+		t->tv_sec++;
+	}
+}
+
+static long long timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+/*
+  Frames sent in parts (see raadhus_proto.h) are put together for each
+  client on its own, see struct source. Parts may come in any order, but
+  only one frame of a client is put together at a time: a part of a newer
+  frame gives up on the current one and parts of older frames are thrown
+  away. A frame which is not complete within FRAME_TIMEOUT_MS is given up
+  as well.
+ */
+#define FRAME_TIMEOUT_MS 100
+/* Parts this many frames older than the current one means the sender restarted */
+#define FRAME_RESTART 64
+
+struct assembly {
+	int active;
+	uint32_t frame;
+	struct timespec started;
+	/* One bit for each byte of the frame we have got */
+	unsigned char *received;
+	int count;
+
+	/*
+	  Frames are put together in the reference frame, which delta coded
+	  parts are XORed onto, and copied to the layer of the client when
+	  they are complete. It holds reference_frame if it is valid
+	 */
+	unsigned char *reference;
+	uint32_t reference_frame;
+	int reference_valid;
+};
+
+/* Statistics of all clients, read by led_thread */
+static struct {
+	unsigned int parts;
+	unsigned int assembled;
+	unsigned int incomplete;
+	unsigned int late;
+	unsigned int no_reference;
+} part_stats;
+
+static void assembly_start(struct assembly *assembly, uint32_t frame,
+			   const struct timespec *now)
+{
+	if (!assembly->received) {
+		assembly->received = malloc((frame_size + 7) / 8);
+		assembly->reference = calloc(1, frame_size);
+	}
+	memset(assembly->received, 0, (frame_size + 7) / 8);
+	assembly->active = 1;
+	assembly->frame = frame;
+	assembly->count = 0;
+	assembly->started = *now;
+}
+
+static void assembly_give_up(struct assembly *assembly)
+{
+	if (assembly->active) {
+		assembly->active = 0;
+		/* Half of the reference frame may be the frame we gave up on */
+		if (assembly->count) {
+			assembly->reference_valid = 0;
+		}
+		__atomic_add_fetch(&part_stats.incomplete, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Marks bytes of the frame as received and returns how many were new */
+static int assembly_mark(struct assembly *assembly, int offset, int length)
+{
+	unsigned char *bits = assembly->received;
+	int end = offset + length, marked = 0;
+
+	for (; offset < end && offset % 8; offset++) {
+		marked += !(bits[offset / 8] & 1 << offset % 8);
+		bits[offset / 8] |= 1 << offset % 8;
+	}
+	for (; offset + 8 <= end; offset += 8) {
+		marked += 8 - __builtin_popcount(bits[offset / 8]);
+		bits[offset / 8] = 0xff;
+	}
+	for (; offset < end; offset++) {
+		marked += !(bits[offset / 8] & 1 << offset % 8);
+		bits[offset / 8] |= 1 << offset % 8;
+	}
+
+	return marked;
+}
+
+/*
+  Each client sending us frames is a layer, see composite(), with counters
+  so we can see who is flooding the wall. The counters are only written by
+  the receiving thread and read without locking by led_thread, which is
+  good enough for statistics. When the table is full the client we have not
+  heard from for the longest time is forgotten.
+ */
+#define MAX_SOURCES 16
+
+static struct source {
+	struct sockaddr_in addr;
+	unsigned int frames;
+	unsigned long long bytes;
+	/* Datagrams rejected or thrown away and frames the ring turned away */
+	unsigned int drops;
+	struct timespec last_seen;
+
+	/* From the layout's source rules */
+	int priority;
+	long long timeout_ns;
+	/* 0 to 256 */
+	int alpha;
+	/* The last complete frame, shown until timeout_ns after last_frame */
+	unsigned char *frame;
+	int has_frame;
+	struct timespec last_frame;
+	/* In the last frame composited, see composite() */
+	int visible;
+	struct assembly assembly;
+} sources[MAX_SOURCES];
+static int source_count;
+
+/* Big enough for a frame or the largest part, followed by the black pixel */
+static int recv_buffer_size(void)
+{
+	return frame_size > MAX_PAYLOAD_SIZE ? frame_size : MAX_PAYLOAD_SIZE;
+}
+
+/* Uses the last source rule matching the client, or the defaults */
+static void source_apply_rules(struct source *source)
+{
+	int i;
+
+	source->priority = 0;
+	source->timeout_ns = DEFAULT_SOURCE_TIMEOUT_MS * 1000000LL;
+	source->alpha = 256;
+	for (i = 0; i < layout.rule_count; i++) {
+		const struct source_rule *rule = &layout.rules[i];
+		if (rule->addr.s_addr == source->addr.sin_addr.s_addr &&
+		    (!rule->port || rule->port == ntohs(source->addr.sin_port))) {
+			source->priority = rule->priority;
+			source->timeout_ns = rule->timeout_ms * 1000000LL;
+			source->alpha = rule->alpha * 256 / 100;
+		}
+	}
+}
+
+static struct source *find_source(const struct sockaddr_in *addr,
+				  const struct timespec *now)
+{
+	struct source *source = &sources[0];
+	unsigned char *frame, *received, *reference;
+	int i;
+
+	for (i = 0; i < source_count; i++) {
+		if (sources[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		    sources[i].addr.sin_port == addr->sin_port) {
+			source = &sources[i];
+			goto found;
+		}
+		if (timespec_diff_ns(&sources[i].last_seen, &source->last_seen) < 0) {
+			source = &sources[i];
+		}
+	}
+	if (source_count < MAX_SOURCES) {
+		source = &sources[source_count++];
+	}
+
+	/* The buffers of a forgotten client are reused */
+	frame = source->frame;
+	received = source->assembly.received;
+	reference = source->assembly.reference;
+	memset(source, 0, sizeof(*source));
+	source->addr = *addr;
+	source->frame = frame ? frame : calloc(1, recv_buffer_size() + FRAME_PADDING);
+	source->assembly.received = received;
+	source->assembly.reference = reference;
+	source_apply_rules(source);
+
+found:
+	source->last_seen = *now;
+	return source;
+}
+
+/*
+  Reads the color correction and the source rules from the layout file
+  again. The controllers are matched by id, the wiring can only be changed
+  with a restart
+ */
+static void reload_layout_colors(void)
+{
+	struct layout *new_layout = malloc(sizeof(*new_layout));
+	int c, n;
+
+	if (read_layout(layout_file, new_layout)) {
+		fprintf(stderr, "%s: keeping the old colors\n", layout_file);
+		free(new_layout);
+		return;
+	}
+
+	for (c = 0; c < layout.controller_count; c++) {
+		for (n = 0; n < new_layout->controller_count; n++) {
+			if (new_layout->controllers[n].id == layout.controllers[c].id) {
+				layout.controllers[c].color = new_layout->controllers[n].color;
+				break;
+			}
+		}
+	}
+	set_colors(&layout);
+
+	layout.rule_count = new_layout->rule_count;
+	memcpy(layout.rules, new_layout->rules, sizeof(layout.rules));
+	for (n = 0; n < source_count; n++) {
+		source_apply_rules(&sources[n]);
+	}
+	fprintf(stderr, "%s: colors and sources reloaded\n", layout_file);
+
+	free(new_layout);
+}
+
+static int is_part(const unsigned char *data, ssize_t size)
+{
+	const struct raadhus_header *header = (const struct raadhus_header *)data;
+	return size >= (ssize_t)sizeof(*header) &&
+		ntohl(header->magic) == RAADHUS_MAGIC &&
+		((ntohs(header->flags) & RAADHUS_RLE) ||
+		 ntohs(header->length) == size - sizeof(*header));
+}
+
+/* Checks that run-length coded data decodes to exactly length bytes */
+static int rle_check(const unsigned char *in, int size, int length)
+{
+	int i = 0, decoded = 0;
+
+	while (i < size) {
+		int count = in[i++];
+		if (count < 128) {
+			i += count + 1;
+			decoded += count + 1;
+		} else {
+			i++;
+			decoded += count - 125;
+		}
+	}
+
+	return i == size && decoded == length ? 0 : -1;
+}
+
+/* Copies bytes, or XORs them on if delta is set */
+static void apply_bytes(unsigned char *out, const unsigned char *in, int length,
+			int delta)
+{
+	int i;
+
+	if (!delta) {
+		memcpy(out, in, length);
+		return;
+	}
+	for (i = 0; i < length; i++) {
+		out[i] ^= in[i];
+	}
+}
+
+/* Decodes a part into out, see raadhus_proto.h for the flags */
+static void decode_part(unsigned char *out, const unsigned char *in, int size,
+			int flags)
+{
+	int delta = flags & RAADHUS_DELTA, i = 0;
+
+	if (!(flags & RAADHUS_RLE)) {
+		apply_bytes(out, in, size, delta);
+		return;
+	}
+
+	while (i < size) {
+		int count = in[i++];
+		if (count < 128) {
+			apply_bytes(out, in + i, count + 1, delta);
+			i += count + 1;
+			out += count + 1;
+		} else {
+			int value = in[i++];
+			if (!delta) {
+				memset(out, value, count - 125);
+			} else if (value) {
+				int j;
+				for (j = 0; j < count - 125; j++) {
+					out[j] ^= value;
+				}
+			}
+			out += count - 125;
+		}
+	}
+}
+
+/*
+  Puts a part of a frame in place and returns 1 if the frame is complete,
+  0 if it is not, or -1 if the part is thrown away
+ */
+static int assemble_part(struct source *source, const unsigned char *data,
+			 ssize_t size, const struct timespec *now)
+{
+	struct assembly *assembly = &source->assembly;
+	struct raadhus_header header;
+	uint32_t number;
+	int32_t age;
+	unsigned int offset, length, flags;
+
+	memcpy(&header, data, sizeof(header));
+	number = ntohl(header.frame);
+	offset = ntohl(header.offset);
+	length = ntohs(header.length);
+	flags = ntohs(header.flags);
+	__atomic_add_fetch(&part_stats.parts, 1, __ATOMIC_RELAXED);
+
+	/* The frame must be ours, and the part inside it */
+	if (ntohl(header.size) != frame_size || offset > frame_size ||
+	    length > frame_size - offset ||
+	    ((flags & RAADHUS_RLE) && rle_check(data + sizeof(header),
+						size - sizeof(header), length))) {
+		return -1;
+	}
+
+	/* Too late if we are done with the frame or have moved on */
+	age = number - assembly->frame;
+	if (assembly->received &&
+	    ((age < 0 && age > -FRAME_RESTART) || (age == 0 && !assembly->active))) {
+		__atomic_add_fetch(&part_stats.late, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	/* A delta needs the frame before this one */
+	if ((flags & RAADHUS_DELTA) &&
+	    (!assembly->reference_valid || assembly->reference_frame != number - 1)) {
+		__atomic_add_fetch(&part_stats.no_reference, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (!assembly->active || age != 0) {
+		assembly_give_up(assembly);
+		assembly_start(assembly, number, now);
+	}
+
+	/* Duplicates must not be XORed on twice */
+	if (assembly_mark(assembly, offset, length) != length) {
+		return -1;
+	}
+	decode_part(assembly->reference + offset, data + sizeof(header),
+		    size - sizeof(header), flags);
+	assembly->count += length;
+	if (assembly->count < frame_size) {
+		return 0;
+	}
+
+	assembly->active = 0;
+	assembly->reference_frame = number;
+	assembly->reference_valid = 1;
+	memcpy(source->frame, assembly->reference, frame_size);
+	__atomic_add_fetch(&part_stats.assembled, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+  Frames can be recorded as they are queued, see raadhus_capture.h. They
+  are written by the receiving thread through a large stdio buffer, so it
+  seldom waits for the disk. With -z they are coded like raadhus_shader
+  sends them, as run-length coded deltas with a keyframe every
+  CAPTURE_KEYFRAME_INTERVAL frames
+ */
+#define CAPTURE_KEYFRAME_INTERVAL 100
+#define CAPTURE_BUFFER_SIZE (256 * 1024)
+
+static struct {
+	FILE *file;
+	int compress;
+	struct timespec started;
+	uint32_t frames;
+	/* Where the records are, for the index */
+	uint64_t *index;
+	uint32_t index_size;
+	uint64_t offset;
+	unsigned char *previous, *delta, *coded;
+} capture;
+
+static int capture_open(const char *filename, int compress)
+{
+	struct raadhus_capture_header header;
+
+	if (!(capture.file = fopen(filename, "wb"))) {
+		perror(filename);
+		return -1;
+	}
+	setvbuf(capture.file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = htonl(RAADHUS_CAPTURE_MAGIC);
+	header.version = htonl(RAADHUS_CAPTURE_VERSION);
+	header.frame_size = htonl(frame_size);
+	if (fwrite(&header, sizeof(header), 1, capture.file) != 1) {
+		perror(filename);
+		fclose(capture.file);
+		capture.file = NULL;
+		return -1;
+	}
+
+	capture.compress = compress;
+	capture.offset = sizeof(header);
+	capture.previous = calloc(1, frame_size);
+	capture.delta = malloc(frame_size);
+	capture.coded = malloc(RAADHUS_RLE_WORST_CASE(frame_size));
+	return 0;
+}
+
+static void capture_frame(const unsigned char *frame, const struct timespec *now)
+{
+	struct raadhus_capture_record record;
+	const unsigned char *data = frame;
+	long long t;
+	int i, used, length = frame_size, flags = 0;
+
+	if (!capture.frames) {
+		capture.started = *now;
+	}
+
+	if (capture.compress) {
+		if (capture.frames % CAPTURE_KEYFRAME_INTERVAL) {
+			for (i = 0; i < frame_size; i++) {
+				capture.delta[i] = frame[i] ^ capture.previous[i];
+			}
+			data = capture.delta;
+			flags = RAADHUS_DELTA;
+		}
+		memcpy(capture.previous, frame, frame_size);
+		/* Noise may well come out longer */
+		if ((i = raadhus_rle_encode(data, frame_size, capture.coded,
+					    RAADHUS_RLE_WORST_CASE(frame_size), &used)) < frame_size) {
+			data = capture.coded;
+			length = i;
+			flags |= RAADHUS_RLE;
+		}
+	}
+
+	if (capture.frames == capture.index_size) {
+		capture.index_size = capture.index_size ? capture.index_size * 2 : 1024;
+		capture.index = realloc(capture.index,
+					capture.index_size * sizeof(*capture.index));
+	}
+	capture.index[capture.frames++] = capture.offset;
+
+	t = timespec_diff_ns(now, &capture.started);
+	record.sec = htonl(t / 1000000000LL);
+	record.nsec = htonl(t % 1000000000LL);
+	record.length = htonl(length);
+	record.flags = htons(flags);
+	record.reserved = 0;
+	if (fwrite(&record, sizeof(record), 1, capture.file) != 1 ||
+	    fwrite(data, length, 1, capture.file) != 1) {
+		/* Keep showing frames, just stop recording them */
+		perror("failed to record frame");
+		fclose(capture.file);
+		capture.file = NULL;
+		return;
+	}
+	capture.offset += sizeof(record) + length;
+}
+
+/* Writes the index and puts where it is in the header */
+static int capture_close(void)
+{
+	struct raadhus_capture_header header;
+	uint32_t i, offset[2];
+	int ret = 0;
+
+	for (i = 0; i < capture.frames; i++) {
+		offset[0] = htonl(capture.index[i] >> 32);
+		offset[1] = htonl(capture.index[i]);
+		if (fwrite(offset, sizeof(offset), 1, capture.file) != 1) {
+			ret = -1;
+		}
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = htonl(RAADHUS_CAPTURE_MAGIC);
+	header.version = htonl(RAADHUS_CAPTURE_VERSION);
+	header.frame_size = htonl(frame_size);
+	header.frame_count = htonl(capture.frames);
+	header.index_offset_high = htonl(capture.offset >> 32);
+	header.index_offset_low = htonl(capture.offset);
+	if (fseek(capture.file, 0, SEEK_SET) < 0 ||
+	    fwrite(&header, sizeof(header), 1, capture.file) != 1) {
+		ret = -1;
+	}
+	if (fclose(capture.file)) {
+		ret = -1;
+	}
+	capture.file = NULL;
+
+	if (ret) {
+		perror("failed to write the capture index");
+	}
+	fprintf(stderr, "recorded %u frames\n", capture.frames);
+	return ret;
+}
+
+/*
+  Layers of the clients, see struct source, are stacked by priority into
+  the frame to queue. A layer hides those below it unless its alpha is
+  below 100%, when they show through and are blended in frame space before
+  gathering, so the gather tables need not change. A new frame is
+  composited whenever a layer which shows gets a frame, and when one times
+  out, so a client given a high priority in the layout, e.g. an emergency
+  message, takes over the wall at once and gives it back when it stops
+  sending. The receiving thread wakes up every LAYER_SWEEP_MS to notice.
+ */
+#define LAYER_SWEEP_MS 10
+
+/*
+  Blends in onto out, with alpha from 0 (out) to 256 (in). Eight bit
+  frames are blended 16 bytes at a time, as the even and odd bytes of 16
+  bit lanes, which the compiler turns into SSE2 or NEON
+ */
+typedef uint16_t blend_vector __attribute__((vector_size(16)));
+
+static void blend(unsigned char *out, const unsigned char *in, int alpha)
+{
+	const blend_vector a = (blend_vector){0} + (uint16_t)alpha;
+	const blend_vector b = (blend_vector){0} + (uint16_t)(256 - alpha);
+	int i = 0;
+
+	if (wide_frames) {
+		for (; i + 1 < frame_size; i += 2) {
+			unsigned int x = in[i] << 8 | in[i + 1];
+			unsigned int y = out[i] << 8 | out[i + 1];
+			unsigned int v = (x * alpha + y * (256 - alpha)) >> 8;
+			out[i] = v >> 8;
+			out[i + 1] = v;
+		}
+		return;
+	}
+
+	for (; i + 16 <= frame_size; i += 16) {
+		blend_vector x, y;
+		memcpy(&x, in + i, 16);
+		memcpy(&y, out + i, 16);
+		x = (((x & 0xff) * a + (y & 0xff) * b) >> 8) |
+			(((x >> 8) * a + (y >> 8) * b) & 0xff00);
+		memcpy(out + i, &x, 16);
+	}
+	for (; i < frame_size; i++) {
+		out[i] = (in[i] * alpha + out[i] * (256 - alpha)) >> 8;
+	}
+}
+
+/*
+  Stacks the layers after source got a new frame, or after a layer timed
+  out if it is NULL, and queues the result. Returns 0 if it was queued or
+  nothing changed on the wall, or -1 if the ring turned it away
+ */
+static int composite(const struct source *source, const struct timespec *now)
+{
+	struct source *layers[MAX_SOURCES];
+	unsigned char *out = ring_recv_frame();
+	int i, j, count = 0, bottom;
+
+	/* Sorted from the top, the client we heard from first staying above on a tie */
+	for (i = 0; i < source_count; i++) {
+		struct source *layer = &sources[i];
+		if (!layer->has_frame ||
+		    timespec_diff_ns(now, &layer->last_frame) > layer->timeout_ns) {
+			continue;
+		}
+		for (j = count; j > 0 && layer->priority > layers[j - 1]->priority; j--) {
+			layers[j] = layers[j - 1];
+		}
+		layers[j] = layer;
+		count++;
+	}
+	/* With nothing left to show the wall keeps the last frame, as it always has */
+	if (!count) {
+		return 0;
+	}
+
+	for (bottom = 0; bottom < count - 1 && layers[bottom]->alpha < 256; bottom++)
+		;
+	/* A frame of a layer which is covered up changes nothing */
+	for (i = bottom + 1; i < count; i++) {
+		if (layers[i] == source) {
+			return 0;
+		}
+	}
+	for (i = 0; i < source_count; i++) {
+		sources[i].visible = 0;
+	}
+	for (i = 0; i <= bottom; i++) {
+		layers[i]->visible = 1;
+	}
+	if (layers[bottom]->alpha < 256) {
+		memset(out, 0, frame_size);
+		blend(out, layers[bottom]->frame, layers[bottom]->alpha);
+	} else {
+		memcpy(out, layers[bottom]->frame, frame_size);
+	}
+	while (bottom-- > 0) {
+		blend(out, layers[bottom]->frame, layers[bottom]->alpha);
+	}
+
+	if (capture.file) {
+		capture_frame(out, now);
+	}
+	/* Only use the frame if output to LEDs is up to speed, or whatever the
+	   drop policy says */
+	return ring_push();
+}
+
+/* Takes down layers which timed out, and composites again if one showed */
+static void expire_layers(const struct timespec *now)
+{
+	int i, expired = 0;
+
+	for (i = 0; i < source_count; i++) {
+		struct source *layer = &sources[i];
+		if (layer->has_frame &&
+		    timespec_diff_ns(now, &layer->last_frame) > layer->timeout_ns) {
+			layer->has_frame = 0;
+			expired |= layer->visible;
+			layer->visible = 0;
+		}
+	}
+	if (expired) {
+		composite(NULL, now);
+	}
+}
+
+/*
+  Finds the records of a mapped capture file, from its index or, without
+  one, by walking them. Returns how many there are
+ */
+static uint32_t replay_index(const unsigned char *map, size_t size,
+			     uint64_t **offsets)
+{
+	struct raadhus_capture_header header;
+	struct raadhus_capture_record record;
+	uint64_t index, offset = sizeof(header);
+	uint32_t i, count;
+
+	memcpy(&header, map, sizeof(header));
+	count = ntohl(header.frame_count);
+	index = (uint64_t)ntohl(header.index_offset_high) << 32 |
+		ntohl(header.index_offset_low);
+
+	if (count && index <= size && (size - index) / 8 >= count) {
+		*offsets = malloc(count * sizeof(**offsets));
+		for (i = 0; i < count; i++) {
+			uint32_t half[2];
+			memcpy(half, map + index + i * 8, sizeof(half));
+			(*offsets)[i] = (uint64_t)ntohl(half[0]) << 32 | ntohl(half[1]);
+		}
+		return count;
+	}
+
+	fprintf(stderr, "no index in the capture file, walking the records\n");
+	*offsets = NULL;
+	for (i = count = 0; offset + sizeof(record) <= size; count++) {
+		memcpy(&record, map + offset, sizeof(record));
+		if (ntohl(record.length) > size - offset - sizeof(record)) {
+			break;
+		}
+		if (count == i) {
+			i = i ? i * 2 : 1024;
+			*offsets = realloc(*offsets, i * sizeof(**offsets));
+		}
+		(*offsets)[count] = offset;
+		offset += sizeof(record) + ntohl(record.length);
+	}
+
+	return count;
+}
+
+/*
+  Plays a capture file into the ring over and over, each frame at the
+  time it was recorded, as if it came in from the network. The file is
+  mapped instead of read, so playing costs next to nothing beyond the
+  decoding
+ */
+static int replay(const char *filename)
+{
+	struct raadhus_capture_header header;
+	struct timespec start;
+	const unsigned char *map;
+	unsigned char *reference;
+	uint64_t *offsets;
+	long long t = 0;
+	uint32_t i, count;
+	struct stat st;
+	int fd, valid;
+
+	if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(filename);
+		return -1;
+	}
+	if (st.st_size < (off_t)sizeof(header) ||
+	    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "%s is not a capture file\n", filename);
+		return -1;
+	}
+	close(fd);
+	madvise((void *)map, st.st_size, MADV_WILLNEED);
+
+	memcpy(&header, map, sizeof(header));
+	if (ntohl(header.magic) != RAADHUS_CAPTURE_MAGIC ||
+	    ntohl(header.version) != RAADHUS_CAPTURE_VERSION) {
+		fprintf(stderr, "%s is not a capture file\n", filename);
+		return -1;
+	}
+	if (ntohl(header.frame_size) != frame_size) {
+		fprintf(stderr, "%s has frames of %u bytes, the layout %d\n",
+			filename, ntohl(header.frame_size), frame_size);
+		return -1;
+	}
+	if (!(count = replay_index(map, st.st_size, &offsets))) {
+		fprintf(stderr, "no frames in %s\n", filename);
+		return -1;
+	}
+
+	reference = calloc(1, frame_size);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		valid = 0;
+		for (i = 0; i < count; i++) {
+			struct raadhus_capture_record record;
+			const unsigned char *data = map + offsets[i] + sizeof(record);
+			struct timespec deadline = start;
+			uint32_t length;
+			int flags;
+
+			if (offsets[i] > st.st_size - sizeof(record)) {
+				continue;
+			}
+			memcpy(&record, map + offsets[i], sizeof(record));
+			length = ntohl(record.length);
+			flags = ntohs(record.flags);
+			if (length > st.st_size - offsets[i] - sizeof(record) ||
+			    ((flags & RAADHUS_RLE) ? rle_check(data, length, frame_size) :
+			     length != frame_size) ||
+			    ((flags & RAADHUS_DELTA) && !valid)) {
+				valid = 0;
+				continue;
+			}
+
+			t = ntohl(record.sec) * 1000000000LL + ntohl(record.nsec);
+			timespec_add_ns(&deadline, t % 1000000000LL);
+			deadline.tv_sec += t / 1000000000LL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+					       NULL) == EINTR)
+				;
+			if (reload_colors) {
+				reload_colors = 0;
+				reload_layout_colors();
+			}
+
+			decode_part(reference, data, length, flags);
+			valid = 1;
+			memcpy(ring_recv_frame(), reference, frame_size);
+			ring_push();
+		}
+
+		/* Start over a frame after the last one */
+		timespec_add_ns(&start, t % 1000000000LL + frame_period_ns);
+		start.tv_sec += t / 1000000000LL;
+	}
+
+	return 0;
+}
+
+/*
+  Datagrams are received in batches with recvmmsg() to save system calls
+  when frames come in bursts or from several clients. Each datagram goes
+  into a buffer of its own. A whole frame becomes the layer of its client
+  by swapping its buffer with the client's, so it is never copied, while
+  parts are copied into place. Kernels before 2.6.33 do not have recvmmsg(), so fall
+  back to receiving one datagram at a time there. Build with -DNO_RECVMMSG
+  if the C library does not have it either.
+ */
+#define RECV_BATCH 16
+
+static struct {
+	unsigned char *buffers[RECV_BATCH];
+	struct sockaddr_in addrs[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+	struct mmsghdr messages[RECV_BATCH];
+	int size;
+} recv_batch;
+
+static void receive_init(void)
+{
+	int i;
+
+	recv_batch.size = recv_buffer_size();
+	for (i = 0; i < RECV_BATCH; i++) {
+		recv_batch.buffers[i] = calloc(1, recv_batch.size + FRAME_PADDING);
+		recv_batch.iovs[i].iov_base = recv_batch.buffers[i];
+		recv_batch.iovs[i].iov_len = recv_batch.size;
+		recv_batch.messages[i].msg_hdr.msg_iov = &recv_batch.iovs[i];
+		recv_batch.messages[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+static int receive_batch(int sockd)
+{
+	ssize_t size;
+	int i;
+#ifndef NO_RECVMMSG
+	static int no_recvmmsg;
+#endif
+
+	for (i = 0; i < RECV_BATCH; i++) {
+		recv_batch.messages[i].msg_hdr.msg_name = &recv_batch.addrs[i];
+		recv_batch.messages[i].msg_hdr.msg_namelen = sizeof(recv_batch.addrs[i]);
+	}
+
+#ifndef NO_RECVMMSG
+	if (!no_recvmmsg) {
+		int count = recvmmsg(sockd, recv_batch.messages, RECV_BATCH,
+				     MSG_WAITFORONE, NULL);
+		if (count >= 0 || errno != ENOSYS) {
+			return count;
+		}
+		no_recvmmsg = 1;
+	}
+#endif
+
+	if ((size = recvmsg(sockd, &recv_batch.messages[0].msg_hdr, 0)) < 0) {
+		return -1;
+	}
+	recv_batch.messages[0].msg_len = size;
+	return 1;
+}
+
+/*
+  Receives the next batch of datagrams, each either a whole frame or a part
+  of one, and composites the frames which are complete. Frames which are too
+  short or too long are thrown away. Returns -1 if receiving failed
+ */
+static int receive_frames(int sockd)
+{
+	struct timespec now;
+	int i, count;
+
+	if ((count = receive_batch(sockd)) < 0) {
+		/* Woken up to look for layers which timed out */
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+		count = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < source_count; i++) {
+		struct assembly *assembly = &sources[i].assembly;
+		if (assembly->active &&
+		    timespec_diff_ns(&now, &assembly->started) > FRAME_TIMEOUT_MS * 1000000LL) {
+			assembly_give_up(assembly);
+		}
+	}
+	expire_layers(&now);
+
+	for (i = 0; i < count; i++) {
+		const struct msghdr *msg = &recv_batch.messages[i].msg_hdr;
+		unsigned char *data = recv_batch.buffers[i];
+		ssize_t size = recv_batch.messages[i].msg_len;
+		struct source *source = find_source(&recv_batch.addrs[i], &now);
+		int complete;
+
+		source->bytes += size;
+		if (msg->msg_flags & MSG_TRUNC) {
+			complete = -1;
+		} else if (is_part(data, size)) {
+			complete = assemble_part(source, data, size, &now);
+		} else if (size == frame_size) {
+			/* A whole frame, which overwrites whatever we were putting together */
+			assembly_give_up(&source->assembly);
+			source->assembly.reference_valid = 0;
+			recv_batch.buffers[i] = source->frame;
+			recv_batch.iovs[i].iov_base = recv_batch.buffers[i];
+			source->frame = data;
+			complete = 1;
+		} else {
+			complete = -1;
+		}
+
+		if (complete < 0) {
+			source->drops++;
+		} else if (complete) {
+			source->frames++;
+			source->has_frame = 1;
+			source->last_frame = now;
+			if (composite(source, &now) < 0) {
+				source->drops++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void sources_dump(void)
+{
+	struct timespec now;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < source_count; i++) {
+		fprintf(stderr, "source %s:%d: priority %d, %u frames, %llu bytes, "
+			"%u dropped, last seen %.1f s ago\n",
+			inet_ntoa(sources[i].addr.sin_addr), ntohs(sources[i].addr.sin_port),
+			sources[i].priority, sources[i].frames, sources[i].bytes, sources[i].drops,
+			timespec_diff_ns(&now, &sources[i].last_seen) / 1e9);
+	}
+}
+
+/*
+  Intervals between the frames sent by led_thread. They are kept in a
+  histogram of 100 us buckets to get the 99th percentile without storing
+  every interval
+ */
+#define JITTER_BUCKET_NS 100000
+#define JITTER_BUCKETS 2000
+
+static struct {
+	unsigned int buckets[JITTER_BUCKETS];
+	unsigned int count;
+	long long sum_ns, min_ns, max_ns;
+	/* Ticks skipped because we were more than a frame late */
+	unsigned int missed;
+	/* Ticks where there was no frame to send */
+	unsigned int empty;
+} jitter;
+
+static void jitter_add(long long interval_ns)
+{
+	long long bucket = interval_ns / JITTER_BUCKET_NS;
+	if (bucket >= JITTER_BUCKETS) {
+		bucket = JITTER_BUCKETS - 1;
+	}
+	jitter.buckets[bucket]++;
+	if (!jitter.count || interval_ns < jitter.min_ns) {
+		jitter.min_ns = interval_ns;
+	}
+	if (interval_ns > jitter.max_ns) {
+		jitter.max_ns = interval_ns;
+	}
+	jitter.sum_ns += interval_ns;
+	jitter.count++;
+}
+
+/*
+  Metrics served by stats_thread. Unlike the statistics above they are
+  never started over. Like the counters of the sources they are written
+  by one thread and read without locking, which is good enough for
+  statistics. Times go into histograms with fixed buckets, from 50 us to
+  a second
+ */
+#define METRIC_BUCKETS 14
+
+static const long long metric_bounds_ns[METRIC_BUCKETS] = {
+	50000, 100000, 250000, 500000, 1000000, 2500000, 5000000,
+	10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+	1000000000
+};
+
+struct histogram {
+	/* The last one is for anything slower */
+	unsigned int buckets[METRIC_BUCKETS + 1];
+	unsigned int count;
+	unsigned long long sum_ns;
+};
+
+static struct {
+	unsigned int ticks;
+	unsigned int missed;
+	unsigned int empty;
+	unsigned int sent;
+	unsigned int send_errors;
+	/* From queueing a frame to sending it to the LEDs */
+	struct histogram latency;
+	/* Gathering the frame into the packets with the color correction */
+	struct histogram gather;
+	struct histogram send;
+} metrics;
+
+static void histogram_add(struct histogram *histogram, long long ns)
+{
+	int i;
+
+	for (i = 0; i < METRIC_BUCKETS && ns > metric_bounds_ns[i]; i++)
+		;
+	histogram->buckets[i]++;
+	histogram->sum_ns += ns;
+	histogram->count++;
+}
+
+/* Prints the statistics since the last dump and starts over */
+static void jitter_dump(void)
+{
+	unsigned int i, seen = 0, p99 = 0;
+
+	for (i = 0; i < JITTER_BUCKETS; i++) {
+		seen += jitter.buckets[i];
+		if (seen * 100ULL >= jitter.count * 99ULL) {
+			p99 = i + 1;
+			break;
+		}
+	}
+
+	fprintf(stderr, "frame period %.2f ms, %u intervals: min %.2f ms, "
+		"avg %.2f ms, max %.2f ms, p99 < %.1f ms, %u missed, %u empty\n",
+		frame_period_ns / 1e6, jitter.count, jitter.min_ns / 1e6,
+		jitter.count ? jitter.sum_ns / 1e6 / jitter.count : 0.0,
+		jitter.max_ns / 1e6, p99 * JITTER_BUCKET_NS / 1e6,
+		jitter.missed, jitter.empty);
+	fprintf(stderr, "ring: %u frames, %u dropped, depth %u, max depth %u\n",
+		__atomic_load_n(&ring.frames, __ATOMIC_RELAXED),
+		__atomic_load_n(&ring.drops, __ATOMIC_RELAXED),
+		ring_depth(), ring.max_depth);
+	fprintf(stderr, "parts: %u received, %u frames assembled, %u incomplete, "
+		"%u late, %u deltas without reference\n",
+		__atomic_load_n(&part_stats.parts, __ATOMIC_RELAXED),
+		__atomic_load_n(&part_stats.assembled, __ATOMIC_RELAXED),
+		__atomic_load_n(&part_stats.incomplete, __ATOMIC_RELAXED),
+		__atomic_load_n(&part_stats.late, __ATOMIC_RELAXED),
+		__atomic_load_n(&part_stats.no_reference, __ATOMIC_RELAXED));
+	sources_dump();
+
+	memset(&jitter, 0, sizeof(jitter));
+}
+
+static void on_sigusr1(int sig)
+{
+	dump_stats = 1;
+}
+
+static void on_sighup(int sig)
+{
+	reload_colors = 1;
+}
+
+static void on_stop(int sig)
+{
+	stop = 1;
+}
+
+/*
+  Sends the packets for all the controllers with as few system calls as
+  possible, so the panels are updated as close together as we can. Kernels
+  before 3.0 do not have sendmmsg(), so fall back to sending them one by one
+  there. Build with -DNO_SENDMMSG if the C library does not have it either.
+ */
+static void send_packets(int sockd)
+{
+	int sent = 0;
+#ifndef NO_SENDMMSG
+	static int no_sendmmsg;
+
+	while (!no_sendmmsg && sent < layout.controller_count) {
+		int ret = sendmmsg(sockd, messages + sent, layout.controller_count - sent, 0);
+		if (ret >= 0) {
+			sent += ret;
+		} else if (errno == ENOSYS) {
+			no_sendmmsg = 1;
+		} else {
+			/* we don't really care, but skip the one that failed */
+			perror("failed");
+			metrics.send_errors++;
+			sent++;
+		}
+	}
+#endif
+
+	for (; sent < layout.controller_count; sent++) {
+		if (send(sockd, packets[sent].payload, packets[sent].size, 0) < 0) {
+			/* we don't really care */
+			perror("failed");
+			metrics.send_errors++;
+		}
+	}
+}
+
+static void *led_thread(void *data)
+{
+	int sockd;
+	struct timespec deadline, last_tick;
+
+	struct sockaddr_in my_addr, dest;
+
+	sockd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (sockd == -1) {
+		perror("Socket creation error");
+		return 0;
+	}
+
+	/* Bind the socket to anything */
+	my_addr.sin_family = AF_INET;
+	my_addr.sin_addr.s_addr = INADDR_ANY;
+	my_addr.sin_port = htons(0);
+
+	if (bind(sockd, (struct sockaddr *)&my_addr, sizeof(my_addr)) < 0) {
+		perror("failed to bind socket");
+	}
+
+	if (mc_interface.s_addr != INADDR_ANY &&
+	    setsockopt(sockd, IPPROTO_IP, IP_MULTICAST_IF, &mc_interface,
+		       sizeof(mc_interface)) < 0) {
+		perror("failed to set multicast interface");
+	}
+
+	/* All controllers listen on the same group, so connect to it once */
+	dest.sin_family = AF_INET;
+	dest.sin_addr.s_addr = inet_addr(MC_GROUP);
+	dest.sin_port = htons(MC_PORT);
+
+	if (connect(sockd, (struct sockaddr *)&dest, sizeof(dest)) < 0) {
+		perror("failed to connect socket");
+	}
+
+	/*
+	  Frames go out on absolute deadlines, so the time spent mapping and
+	  sending does not add up to drift
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	last_tick = deadline;
+
+	while (1) {
+		const unsigned char *frame;
+		struct color_table *tables;
+		struct timespec now, gathered, sent;
+		long long late;
+		int c;
+
+		timespec_add_ns(&deadline, frame_period_ns);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+				       NULL) == EINTR)
+			;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		/* Skip the ticks we missed instead of sending a burst of frames */
+		if ((late = timespec_diff_ns(&now, &deadline)) >= frame_period_ns) {
+			jitter.missed += late / frame_period_ns;
+			metrics.missed += late / frame_period_ns;
+			deadline = now;
+		}
+		jitter_add(timespec_diff_ns(&now, &last_tick));
+		last_tick = now;
+		metrics.ticks++;
+
+		if (dump_stats) {
+			dump_stats = 0;
+			jitter_dump();
+		}
+
+		if (!(frame = ring_pop())) {
+			jitter.empty++;
+			metrics.empty++;
+			continue;
+		}
+
+		tables = colors_acquire();
+		for (c = 0; c < layout.controller_count; c++) {
+			if (wide_frames) {
+				gather_wide_packet(frame, &packets[c], &tables[c]);
+			} else {
+				gather_packet(frame, &packets[c], tables[c].narrow[0]);
+			}
+		}
+		colors_release();
+		clock_gettime(CLOCK_MONOTONIC, &gathered);
+		send_packets(sockd);
+		clock_gettime(CLOCK_MONOTONIC, &sent);
+
+		histogram_add(&metrics.gather, timespec_diff_ns(&gathered, &now));
+		histogram_add(&metrics.send, timespec_diff_ns(&sent, &gathered));
+		histogram_add(&metrics.latency, timespec_diff_ns(&sent, ring_queued()));
+		metrics.sent++;
+	}
+
+	return 0;
+}
+
+static void print_histogram(FILE *out, const char *name, const char *help,
+			    const struct histogram *histogram)
+{
+	unsigned int i, count = 0;
+
+	fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for (i = 0; i < METRIC_BUCKETS; i++) {
+		count += histogram->buckets[i];
+		fprintf(out, "%s_bucket{le=\"%g\"} %u\n", name, metric_bounds_ns[i] / 1e9, count);
+	}
+	fprintf(out, "%s_bucket{le=\"+Inf\"} %u\n%s_sum %.6f\n%s_count %u\n",
+		name, histogram->count, name, histogram->sum_ns / 1e9, name,
+		histogram->count);
+}
+
+static void print_metric(FILE *out, const char *name, const char *type,
+			 const char *help, double value)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n",
+		name, help, name, type, name, value);
+}
+
+/* Writes the metrics as Prometheus text and returns its length */
+static int write_metrics(char *text, int size)
+{
+	FILE *out = fmemopen(text, size, "w");
+	long length;
+
+	if (!out) {
+		return 0;
+	}
+	print_metric(out, "raadhus_frames_received_total", "counter",
+		     "Frames received and offered to the ring",
+		     __atomic_load_n(&ring.frames, __ATOMIC_RELAXED));
+	print_metric(out, "raadhus_frames_dropped_total", "counter",
+		     "Frames dropped by the ring",
+		     __atomic_load_n(&ring.drops, __ATOMIC_RELAXED));
+	print_metric(out, "raadhus_frames_sent_total", "counter",
+		     "Frames sent to the LEDs", metrics.sent);
+	print_metric(out, "raadhus_ring_depth", "gauge",
+		     "Frames queued in the ring", ring_depth());
+	print_metric(out, "raadhus_ring_max_depth", "gauge",
+		     "Most frames ever queued in the ring", ring.max_depth);
+	print_metric(out, "raadhus_ticks_total", "counter",
+		     "Ticks of the output clock", metrics.ticks);
+	print_metric(out, "raadhus_ticks_missed_total", "counter",
+		     "Ticks skipped because the output clock was late", metrics.missed);
+	print_metric(out, "raadhus_ticks_empty_total", "counter",
+		     "Ticks without a frame to send", metrics.empty);
+	print_metric(out, "raadhus_send_errors_total", "counter",
+		     "Packets to the LEDs that failed to send", metrics.send_errors);
+	print_metric(out, "raadhus_parts_total", "counter",
+		     "Parts of frames received",
+		     __atomic_load_n(&part_stats.parts, __ATOMIC_RELAXED));
+	print_metric(out, "raadhus_parts_incomplete_total", "counter",
+		     "Frames given up on before all their parts came",
+		     __atomic_load_n(&part_stats.incomplete, __ATOMIC_RELAXED));
+	print_metric(out, "raadhus_parts_late_total", "counter",
+		     "Parts of frames already done with",
+		     __atomic_load_n(&part_stats.late, __ATOMIC_RELAXED));
+	print_metric(out, "raadhus_parts_no_reference_total", "counter",
+		     "Deltas thrown away for lack of the frame before",
+		     __atomic_load_n(&part_stats.no_reference, __ATOMIC_RELAXED));
+	print_metric(out, "raadhus_sources", "gauge",
+		     "Clients that have sent frames", source_count);
+	print_histogram(out, "raadhus_latency_seconds",
+			"Time from queueing a frame to sending it to the LEDs",
+			&metrics.latency);
+	print_histogram(out, "raadhus_gather_seconds",
+			"Time mapping a frame into the packets with color correction",
+			&metrics.gather);
+	print_histogram(out, "raadhus_send_seconds",
+			"Time sending the packets of a frame", &metrics.send);
+
+	length = ftell(out);
+	fclose(out);
+	return length < size ? length : size;
+}
+
+/*
+  Answers every datagram to the stats port with the metrics, e.g.
+  'echo | nc -u -w 1 127.0.0.1 1235'. It is only bound to localhost
+ */
+static void *stats_thread(void *data)
+{
+	int sockd = (intptr_t)data;
+	static char text[16384];
+
+	for (;;) {
+		struct sockaddr_in from;
+		socklen_t length = sizeof(from);
+		char query[64];
+
+		if (recvfrom(sockd, query, sizeof(query), 0, (struct sockaddr *)&from,
+			     &length) < 0) {
+			continue;
+		}
+		sendto(sockd, text, write_metrics(text, sizeof(text)), 0,
+		       (struct sockaddr *)&from, length);
+	}
+
+	return NULL;
+}
+
+static int start_stats(int port)
+{
+	struct sockaddr_in addr;
+	pthread_t tid;
+	int sockd;
+
+	if ((sockd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		return -1;
+	}
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(sockd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sockd);
+		return -1;
+	}
+
+	pthread_create(&tid, NULL, stats_thread, (void *)(intptr_t)sockd);
+	pthread_detach(tid);
+	return 0;
+}
+
+static double elapsed_sec(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static const char *policy_names[] = { "newest", "oldest", "latest" };
+
+static int ring_benchmark_frames;
+static int ring_benchmark_done;
+
+static void *ring_benchmark_producer(void *data)
+{
+	unsigned int seq;
+	for (seq = 1; seq <= ring_benchmark_frames; seq++) {
+		unsigned char *frame = ring_recv_frame();
+		/* Stamp both ends so a frame overwritten while it is being read
+		   shows up as a mismatch */
+		memcpy(frame, &seq, sizeof(seq));
+		memcpy(frame + frame_size - sizeof(seq), &seq, sizeof(seq));
+		ring_push();
+	}
+	__atomic_store_n(&ring_benchmark_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+  Hammers the ring from two threads with each drop policy and checks that
+  frames arrive in order, intact and are all accounted for
+ */
+static int ring_benchmark(int frames)
+{
+	enum drop_policy policy;
+	int ret = 0;
+
+	ring_benchmark_frames = frames;
+	for (policy = DROP_NEWEST; policy <= LATEST_WINS; policy++) {
+		unsigned int last = 0, received = 0, errors = 0;
+		struct timespec start;
+		pthread_t tid;
+		double t;
+
+		ring_init(policy);
+		/* Not part of the run */
+		ring_pop();
+		ring_benchmark_done = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pthread_create(&tid, NULL, ring_benchmark_producer, NULL);
+		while (1) {
+			int done = __atomic_load_n(&ring_benchmark_done, __ATOMIC_ACQUIRE);
+			const unsigned char *frame = ring_pop();
+			unsigned int seq, seq_end;
+			if (!frame) {
+				if (done) {
+					break;
+				}
+				sched_yield();
+				continue;
+			}
+			memcpy(&seq, frame, sizeof(seq));
+			memcpy(&seq_end, frame + frame_size - sizeof(seq), sizeof(seq));
+			if (seq != seq_end || seq <= last) {
+				errors++;
+			}
+			last = seq;
+			received++;
+		}
+		pthread_join(tid, NULL);
+		t = elapsed_sec(&start);
+
+		if (received + ring.drops != frames) {
+			errors++;
+		}
+		printf("ring, drop %s: %d frames in %.3f s, %.1f frames/s, "
+		       "%u received, %u dropped, max depth %u, %u errors\n",
+		       policy_names[policy], frames, t, frames / t,
+		       received, ring.drops, ring.max_depth, errors);
+		if (errors) {
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/* Reference color correction, as a pass of its own over a mapped screen */
+static void color_screen(unsigned char *screen, const struct controller *controller,
+			 const struct color_table *table)
+{
+	int i, size = controller_bytes(controller);
+
+	for (i = 0; i < size; i++) {
+		screen[i] = table->narrow[i % 3][screen[i]];
+	}
+}
+
+/*
+  Times wide frames through the dithering. It also checks that nothing is
+  lost: showing the same frame a number of times, what the LEDs showed
+  plus the error left must add up to the values of the frame exactly
+ */
+#define DITHER_CHECK_FRAMES 16
+
+static int benchmark_wide(int frames)
+{
+	unsigned char *frame = malloc(frame_samples * 2 + FRAME_PADDING);
+	struct timespec start;
+	double t_wide;
+	int i, c, n, s, ret = 0;
+
+	for (i = 0; i < frame_samples * 2; i++) {
+		frame[i] = rand();
+	}
+	memset(frame + frame_samples * 2, 0, FRAME_PADDING);
+
+	for (c = 0; c < layout.controller_count; c++) {
+		struct packet *packet = &packets[c];
+		unsigned int *shown = calloc(packet->length, sizeof(*shown));
+
+		memset(packet->error, 0, packet->length);
+		for (n = 0; n < DITHER_CHECK_FRAMES; n++) {
+			gather_wide_packet(frame, packet, &colors.current[c]);
+			for (s = 0, i = 0; s < packet->span_count; s++) {
+				const unsigned char *out = packet->payload + packet->spans[s].offset;
+				int j;
+				for (j = 0; j < packet->spans[s].length; j++) {
+					shown[i++] += out[j];
+				}
+			}
+		}
+		for (i = 0; i < packet->length; i++) {
+			if (shown[i] * 256 + packet->error[i] !=
+			    packet->wide[i] * DITHER_CHECK_FRAMES) {
+				fprintf(stderr, "dithering of packet %d is off at %d\n", c, i);
+				ret = -1;
+				break;
+			}
+		}
+		free(shown);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < frames; i++) {
+		frame[i % (frame_samples * 2)]++;
+		for (c = 0; c < layout.controller_count; c++) {
+			gather_wide_packet(frame, &packets[c], &colors.current[c]);
+		}
+	}
+	t_wide = elapsed_sec(&start);
+
+	printf("gather_wide_packet + dither:         %d frames in %.3f s, %.1f frames/s\n",
+	       frames, t_wide, frames / t_wide);
+
+	free(frame);
+	return ret;
+}
+
+/* Checks blend() against a byte at a time, and times the two */
+static int benchmark_blend(int frames)
+{
+	unsigned char *in = malloc(frame_size), *out = malloc(frame_size);
+	unsigned char *expected = malloc(frame_size);
+	struct timespec start;
+	double t_vector, t_scalar;
+	int i, n, alpha, ret = 0;
+
+	for (n = 0; n < 100 && !ret; n++) {
+		alpha = n == 0 ? 0 : n == 1 ? 256 : rand() % 257;
+		for (i = 0; i < frame_size; i++) {
+			in[i] = rand();
+			out[i] = rand();
+			expected[i] = (in[i] * alpha + out[i] * (256 - alpha)) >> 8;
+		}
+		blend(out, in, alpha);
+		if (memcmp(out, expected, frame_size)) {
+			fprintf(stderr, "blend with alpha %d is off\n", alpha);
+			ret = -1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < frames; n++) {
+		blend(out, in, n & 255);
+	}
+	t_vector = elapsed_sec(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < frames; n++) {
+		alpha = n & 255;
+		for (i = 0; i < frame_size; i++) {
+			expected[i] = (in[i] * alpha + expected[i] * (256 - alpha)) >> 8;
+		}
+	}
+	t_scalar = elapsed_sec(&start);
+
+	printf("blend:                               %d frames in %.3f s, %.1f frames/s\n",
+	       frames, t_vector, frames / t_vector);
+	printf("blend a byte at a time:              %d frames in %.3f s, %.1f frames/s\n",
+	       frames, t_scalar, frames / t_scalar);
+
+	free(in);
+	free(out);
+	free(expected);
+	return ret;
+}
+
+/*
+  Gives a layer a frame of one value and returns the value of the last frame
+  queued since, or -1 if none was
+ */
+static int check_layer_frame(struct source *source, int value,
+			     const struct timespec *now)
+{
+	const unsigned char *frame;
+
+	if (source) {
+		memset(source->frame, value, frame_size);
+		source->has_frame = 1;
+		source->last_frame = *now;
+		composite(source, now);
+	} else {
+		expire_layers(now);
+	}
+	for (value = -1; (frame = ring_pop()); value = frame[0])
+		;
+	return value;
+}
+
+/*
+  Checks that a show under a 50% layer keeps moving, that a show under an
+  opaque layer is hidden, and that it comes back when that layer times out
+ */
+static int check_layers(void)
+{
+	struct sockaddr_in show, notice;
+	struct timespec now;
+	struct source *low, *high;
+	int errors = 0;
+
+	ring_init(DROP_OLDEST);
+	ring_pop();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	memset(&show, 0, sizeof(show));
+	memset(&notice, 0, sizeof(notice));
+	show.sin_port = htons(1);
+	notice.sin_port = htons(2);
+	low = find_source(&show, &now);
+	high = find_source(&notice, &now);
+	high->priority = 1;
+	high->alpha = 128;
+
+	errors += check_layer_frame(low, 0x10, &now) != 0x10;
+	errors += check_layer_frame(high, 0xf0, &now) != 0x80;
+	errors += check_layer_frame(low, 0x20, &now) != 0x88;
+	high->alpha = 256;
+	errors += check_layer_frame(high, 0xf0, &now) != 0xf0;
+	errors += check_layer_frame(low, 0x30, &now) != -1;
+	high->last_frame.tv_sec -= high->timeout_ns / 1000000000LL + 1;
+	errors += check_layer_frame(NULL, 0, &now) != 0x30;
+
+	printf("layers: a show under a 50%% and an opaque layer, %d errors\n", errors);
+
+	/* Forget them again */
+	source_count = 0;
+	return errors ? -1 : 0;
+}
+
+/*
+  Checks the packets against the reference decoder of raadhus_ytkj.h,
+  so the packetizer can be changed without fear. There is a golden
+  packet from payload_buffer() which must come out the same to the bit,
+  gather_packet() on random frames against the reference mapping, both
+  encoders on random controllers, and mangled packets to see that the
+  decoder copes with anything
+ */
+#define YTKJ_CHECK_FRAMES 100
+#define YTKJ_RANDOM_CONTROLLERS 1000
+#define YTKJ_FUZZ_PACKETS 10000
+/* Of the golden packet, see check_golden() */
+#define GOLDEN_SIZE 1862
+#define GOLDEN_HASH 0xb59d1194u
+
+static uint32_t fnv1a(const unsigned char *data, int size)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/*
+  A controller with a port too long for one chunk and a short one after
+  it, so the packet has a split port, a channel rounded up to the next
+  port and a tail lost to the dummy header
+ */
+static int check_golden(struct ytkj_ports *ports)
+{
+	struct controller controller;
+	unsigned char screen[1830], *payload;
+	int i, size, ret = 0;
+
+	memset(&controller, 0, sizeof(controller));
+	controller.id = 3;
+	controller.port_count = 2;
+	controller.ports[0].strip_count = 1;
+	controller.ports[0].strips[0].pixels = 600;
+	controller.ports[1].strip_count = 1;
+	controller.ports[1].strips[0].pixels = 10;
+	for (i = 0; i < sizeof(screen); i++) {
+		screen[i] = i * 7;
+	}
+
+	payload = malloc(max_payload_size(&controller));
+	size = payload_buffer(screen, payload, &controller, NULL, NULL);
+	if (size != GOLDEN_SIZE || fnv1a(payload, size) != GOLDEN_HASH) {
+		fprintf(stderr, "golden packet differs: %d bytes, hash %08x\n",
+			size, fnv1a(payload, size));
+		ret = -1;
+	} else if (ytkj_decode(payload, size, ports) != 1800 + 22 ||
+		   ports->id != 3 || ports->chunks != 2 ||
+		   ports->count[0] != 1800 || ports->count[1] != 22 ||
+		   memcmp(ports->channels[0], screen, 1800) ||
+		   memcmp(ports->channels[1], screen + 1800, 22)) {
+		fprintf(stderr, "golden packet decodes wrong\n");
+		ret = -1;
+	}
+
+	free(payload);
+	return ret;
+}
+
+/*
+  Checks that the ports got the first decoded bytes of the mapped screen of
+  their controller, in order
+ */
+static int check_ports(const struct ytkj_ports *ports, int decoded,
+		       const struct controller *controller,
+		       const unsigned char *screen)
+{
+	int p, left = decoded;
+
+	if (ports->id != controller->id) {
+		return -1;
+	}
+	for (p = 0; p < controller->port_count; p++) {
+		int bytes = port_bytes(&controller->ports[p]);
+		int sent = bytes < left ? bytes : left > 0 ? left : 0;
+		if (ports->count[p] != sent || memcmp(ports->channels[p], screen, sent)) {
+			return -1;
+		}
+		screen += bytes;
+		left -= bytes;
+	}
+
+	return 0;
+}
+
+/*
+  Chunks in a packet of a controller, counting those after the end. Each
+  chunk after the first has a dummy header which is not counted in the
+  size of the packet, so that many bytes at the end are never sent, and
+  whole chunks can be among them. It is the fewest chunks for which the
+  packet with its tail holds all the LED bytes, or -1 if none do
+ */
+static int packet_chunks(const unsigned char *payload, int size,
+			 const struct controller *controller,
+			 struct ytkj_ports *ports)
+{
+	int chunks, total = controller_bytes(controller);
+
+	for (chunks = 1; chunks <= max_spans(controller); chunks++) {
+		if (ytkj_decode(payload, size + YTKJ_DUMMY_HEADER * (chunks - 1),
+				ports) >= total) {
+			return chunks;
+		}
+	}
+	return -1;
+}
+
+/*
+  Checks what a packet sends to each port against the mapped screen of its
+  controller. The bytes never sent are LED data, or entries of ports which
+  then get nothing, so the ports must get a start of the screen at most
+  that much short of all of it
+ */
+static int check_decoded(struct ytkj_ports *ports, const unsigned char *payload,
+			 int size, const struct controller *controller,
+			 const unsigned char *screen)
+{
+	int chunks = packet_chunks(payload, size, controller, ports);
+	int decoded = ytkj_decode(payload, size, ports);
+	int total = controller_bytes(controller);
+
+	if (chunks < 0 || decoded < total - YTKJ_DUMMY_HEADER * (chunks - 1) ||
+	    decoded > total) {
+		return -1;
+	}
+	return check_ports(ports, decoded, controller, screen);
+}
+
+/*
+  A controller with random ports of random strips, up to a full port of
+  2048 channels, so the ports end anywhere in a chunk and often need more
+  than one. Some strips show columns outside the frame or nothing
+ */
+static void random_controller(struct controller *controller)
+{
+	int p, s;
+
+	memset(controller, 0, sizeof(*controller));
+	controller->id = 1 + rand() % 255;
+	controller->port_count = 1 + rand() % PORTS_PER_CONTROLLER;
+	for (p = 0; p < controller->port_count; p++) {
+		struct port *port = &controller->ports[p];
+		int left = CHANNELS_PER_PORT / 3;
+
+		port->strip_count = 1 + rand() % MAX_STRIPS_ON_PORT;
+		for (s = 0; s < port->strip_count; s++) {
+			struct strip *strip = &port->strips[s];
+			/* Long strips half of the time, to fill up chunks */
+			int pixels = 1 + rand() % (rand() % 2 ? left : layout.height + 2);
+
+			strip->pixels = pixels < left ? pixels : left;
+			strip->column = rand() % (layout.width + 2) - 1;
+			strip->order = rand() % 4;
+			left -= strip->pixels;
+			if (!left) {
+				port->strip_count = s + 1;
+			}
+		}
+	}
+}
+
+/*
+  Runs payload_buffer() and the prebuilt packet of a random controller on a
+  frame through the decoder. Returns the number of errors
+ */
+static int check_random_controller(const unsigned char *frame, struct ytkj_ports *ports)
+{
+	struct controller controller;
+	struct packet packet;
+	unsigned char identity[3][256], *screen, *payload;
+	int i, size, errors = 0;
+
+	random_controller(&controller);
+	for (i = 0; i < 256; i++) {
+		identity[0][i] = identity[1][i] = identity[2][i] = i;
+	}
+	screen = malloc(controller_bytes(&controller));
+	payload = malloc(max_payload_size(&controller));
+	memset(&packet, 0, sizeof(packet));
+	build_packet(&packet, &controller);
+
+	map_controller(frame, &controller, screen);
+	size = payload_buffer(screen, payload, &controller, NULL, NULL);
+	if (check_decoded(ports, payload, size, &controller, screen)) {
+		errors++;
+	}
+	/* With the tail which is never sent all of the screen is there */
+	i = size + YTKJ_DUMMY_HEADER * (packet_chunks(payload, size, &controller, ports) - 1);
+	if (ytkj_decode(payload, i, ports) != controller_bytes(&controller) ||
+	    check_ports(ports, controller_bytes(&controller), &controller, screen)) {
+		errors++;
+	}
+	gather_packet(frame, &packet, identity[0]);
+	if (packet.size != size || memcmp(packet.payload, payload, size) ||
+	    check_decoded(ports, packet.payload, packet.size, &controller, screen)) {
+		errors++;
+	}
+	if (errors) {
+		fprintf(stderr, "random controller with %d ports of %d bytes decodes wrong\n",
+			controller.port_count, controller_bytes(&controller));
+	}
+
+	free(screen);
+	free(payload);
+	free(packet.payload);
+	free(packet.spans);
+	free((void *)packet.lut);
+	free(packet.wide);
+	free(packet.error);
+	return errors;
+}
+
+static int check_ytkj(void)
+{
+	struct ytkj_ports *ports = malloc(sizeof(*ports));
+	unsigned char *frame = malloc(frame_samples + FRAME_PADDING);
+	unsigned char **screen = calloc(layout.controller_count, sizeof(*screen));
+	unsigned char *mangled;
+	int i, c, n, size = 0, errors = 0, rejected = 0;
+
+	if (check_golden(ports)) {
+		errors++;
+	}
+
+	for (c = 0; c < layout.controller_count; c++) {
+		screen[c] = calloc(1, controller_bytes(&layout.controllers[c]));
+		if (packets[c].size > size) {
+			size = packets[c].size;
+		}
+	}
+	mangled = malloc(size);
+
+	memset(frame + frame_samples, 0, FRAME_PADDING);
+	for (n = 0; n < YTKJ_CHECK_FRAMES; n++) {
+		for (i = 0; i < frame_samples; i++) {
+			frame[i] = rand();
+		}
+		map_pixels(frame, screen);
+		for (c = 0; c < layout.controller_count; c++) {
+			struct packet *packet = &packets[c];
+			color_screen(screen[c], &layout.controllers[c], &colors.current[c]);
+			gather_packet(frame, packet, colors.current[c].narrow[0]);
+			if (check_decoded(ports, packet->payload, packet->size,
+					  &layout.controllers[c], screen[c])) {
+				fprintf(stderr, "packet %d of frame %d decodes wrong\n", c, n);
+				errors++;
+			}
+		}
+	}
+
+	for (n = 0; n < YTKJ_RANDOM_CONTROLLERS; n++) {
+		errors += check_random_controller(frame, ports);
+	}
+
+	/* Random bytes changed and cut off. It must not crash or read past the end */
+	for (n = 0; n < YTKJ_FUZZ_PACKETS; n++) {
+		struct packet *packet = &packets[n % layout.controller_count];
+		int length = rand() % (packet->size + 1);
+
+		memcpy(mangled, packet->payload, length);
+		for (i = rand() % 4; i > 0 && length; i--) {
+			mangled[rand() % length] = rand();
+		}
+		if ((c = ytkj_decode(mangled, length, ports)) < 0) {
+			rejected++;
+		} else if (c > length) {
+			errors++;
+		}
+	}
+
+	printf("ytkj: golden packet, %d frames decoded, %d random controllers, "
+	       "%d mangled packets of which %d rejected, %d errors\n",
+	       YTKJ_CHECK_FRAMES, YTKJ_RANDOM_CONTROLLERS, YTKJ_FUZZ_PACKETS,
+	       rejected, errors);
+
+	for (c = 0; c < layout.controller_count; c++) {
+		free(screen[c]);
+	}
+	free(screen);
+	free(mangled);
+	free(frame);
+	free(ports);
+	return errors ? -1 : 0;
+}
+
+/*
+  Runs the old path (map_pixels() followed by payload_buffer()) and the
+  prebuilt packets against each other on random frames and prints the frame
+  rate of both
+ */
+static int benchmark(int frames)
+{
+	unsigned char *frame = malloc(frame_samples + FRAME_PADDING);
+	unsigned char **screen = calloc(layout.controller_count, sizeof(*screen));
+	unsigned char *payload;
+	struct timespec start;
+	double t_ref, t_lut;
+	int i, c, size = 0, ret = 0;
+
+	for (i = 0; i < frame_samples; i++) {
+		frame[i] = rand();
+	}
+	memset(frame + frame_samples, 0, FRAME_PADDING);
+	for (c = 0; c < layout.controller_count; c++) {
+		screen[c] = calloc(1, controller_bytes(&layout.controllers[c]));
+		if (max_payload_size(&layout.controllers[c]) > size) {
+			size = max_payload_size(&layout.controllers[c]);
+		}
+	}
+	payload = malloc(size);
+
+	map_pixels(frame, screen);
+	for (c = 0; c < layout.controller_count; c++) {
+		color_screen(screen[c], &layout.controllers[c], &colors.current[c]);
+		size = payload_buffer(screen[c], payload, &layout.controllers[c],
+				      NULL, NULL);
+		gather_packet(frame, &packets[c], colors.current[c].narrow[0]);
+		if (size != packets[c].size ||
+		    memcmp(payload, packets[c].payload, size)) {
+			fprintf(stderr, "packet %d differs from payload_buffer()\n", c);
+			ret = -1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < frames; i++) {
+		/* Vary the input a bit so the loops cannot be hoisted */
+		frame[i % frame_samples]++;
+		map_pixels(frame, screen);
+		for (c = 0; c < layout.controller_count; c++) {
+			color_screen(screen[c], &layout.controllers[c], &colors.current[c]);
+			payload_buffer(screen[c], payload, &layout.controllers[c],
+				       NULL, NULL);
+		}
+	}
+	t_ref = elapsed_sec(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < frames; i++) {
+		frame[i % frame_samples]++;
+		for (c = 0; c < layout.controller_count; c++) {
+			gather_packet(frame, &packets[c], colors.current[c].narrow[0]);
+		}
+	}
+	t_lut = elapsed_sec(&start);
+
+	printf("map_pixels + color + payload_buffer: %d frames in %.3f s, %.1f frames/s\n",
+	       frames, t_ref, frames / t_ref);
+	printf("gather_packet:                       %d frames in %.3f s, %.1f frames/s\n",
+	       frames, t_lut, frames / t_lut);
+
+	for (c = 0; c < layout.controller_count; c++) {
+		free(screen[c]);
+	}
+	free(screen);
+	free(payload);
+	free(frame);
+
+	if (check_ytkj() || benchmark_wide(frames) || benchmark_blend(frames) ||
+	    check_layers() || ring_benchmark(frames)) {
+		ret = -1;
+	}
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tid;
+	enum drop_policy policy = DROP_NEWEST;
+	struct sockaddr_in my_addr;
+	struct sigaction action;
+	struct timeval sweep;
+	const char *record_file = NULL, *replay_file = NULL;
+	int sockd, opt, bench_frames = 0, check_only = 0, compress_capture = 0;
+	int stats_port = STATS_PORT;
+
+	while ((opt = getopt(argc, argv, "b:cd:f:i:l:m:p:r:wz")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench_frames = atoi(optarg);
+			break;
+		case 'c':
+			check_only = 1;
+			break;
+		case 'l':
+			layout_file = optarg;
+			break;
+		case 'w':
+			wide_frames = 1;
+			break;
+		case 'r':
+			record_file = optarg;
+			break;
+		case 'z':
+			compress_capture = 1;
+			break;
+		case 'p':
+			replay_file = optarg;
+			break;
+		case 'm':
+			stats_port = parse_int(optarg, 0, 65535);
+			if (stats_port < 0) {
+				fprintf(stderr, "Invalid stats port %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			if (atof(optarg) <= 0) {
+				fprintf(stderr, "Invalid frame rate %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			frame_period_ns = 1e9 / atof(optarg);
+			break;
+		case 'i':
+			if (!inet_aton(optarg, &mc_interface)) {
+				fprintf(stderr, "Invalid interface address %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			if (!strcmp(optarg, "newest")) {
+				policy = DROP_NEWEST;
+			} else if (!strcmp(optarg, "oldest")) {
+				policy = DROP_OLDEST;
+			} else if (!strcmp(optarg, "latest")) {
+				policy = LATEST_WINS;
+			} else {
+				fprintf(stderr, "Unknown drop policy %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b frames] [-c] [-d newest|oldest|latest] "
+				"[-f fps] [-i address] [-l layout] [-m port] [-p capture] "
+				"[-r capture [-z]] [-w]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (read_layout(layout_file, &layout)) {
+		return EXIT_FAILURE;
+	}
+	frame_samples = layout.width * layout.height * 3;
+	frame_size = wide_frames ? frame_samples * 2 : frame_samples;
+	wide_tables = wide_frames || bench_frames;
+	/* Problems are not fatal, the wall may well be wired up like that */
+	if (check_layout() && check_only) {
+		return EXIT_FAILURE;
+	} else if (check_only) {
+		return 0;
+	}
+	build_packets();
+
+	if (bench_frames) {
+		return benchmark(bench_frames) ? EXIT_FAILURE : 0;
+	}
+
+	ring_init(policy);
+	signal(SIGUSR1, on_sigusr1);
+	/* Without SA_RESTART, so the receive loop gets to reload the colors */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_sighup;
+	sigaction(SIGHUP, &action, NULL);
+
+	sockd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (sockd == -1) {
+		perror("Socket creation error");
+		return -2;
+	}
+
+	/* Not fatal, the wall works without them */
+	if (stats_port && start_stats(stats_port) < 0) {
+		perror("failed to serve metrics");
+	}
+
+	/* Start LED thread */
+	pthread_create(&tid, NULL, led_thread, NULL);
+	pthread_detach(tid);
+
+	if (replay_file) {
+		return replay(replay_file) ? EXIT_FAILURE : 0;
+	}
+
+	if (record_file) {
+		if (capture_open(record_file, compress_capture)) {
+			return EXIT_FAILURE;
+		}
+		/* The index is written on the way out */
+		action.sa_handler = on_stop;
+		sigaction(SIGINT, &action, NULL);
+		sigaction(SIGTERM, &action, NULL);
+	}
+
+	/* Bind the socket to our listening port */
+	my_addr.sin_family = AF_INET;
+	my_addr.sin_addr.s_addr = INADDR_ANY;
+	my_addr.sin_port = htons(LISTEN_PORT);
+
+	bind(sockd, (struct sockaddr *)&my_addr, sizeof(my_addr));
+
+	/* Wake up now and then to take down layers which timed out */
+	sweep.tv_sec = 0;
+	sweep.tv_usec = LAYER_SWEEP_MS * 1000;
+	setsockopt(sockd, SOL_SOCKET, SO_RCVTIMEO, &sweep, sizeof(sweep));
+
+	receive_init();
+	while ((receive_frames(sockd) >= 0 || errno == EINTR) && !stop) {
+		if (reload_colors) {
+			reload_colors = 0;
+			reload_layout_colors();
+		}
+	}
+
+	if (capture.file && capture_close()) {
+		return EXIT_FAILURE;
+	}
 	return 0;
 }
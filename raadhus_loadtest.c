@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include "raadhus_proto.h"
+
+/*
+  Load test of raadhus_daemon on a single machine. It starts the daemon
+  with its LEDs on the loopback interface, sends it frames at a given
+  rate and in bursts, and listens to the packets it sends to the LEDs,
+  to see how many frames make it through and how long they take from
+  being sent to being on the wire. It runs a copy of the layout without
+  the color correction, so the colors of the frames come out as they went
+  in: every pixel of frame n has the color n, with the top bit of blue set
+  so it tells from an LED showing nothing.
+ */
+#define LISTEN_PORT 1234
+#define MC_GROUP "224.1.1.1"
+#define MC_PORT 1097
+#define LED_DATA 14
+#define MAX_DAEMON_ARGS 32
+
+static const char *daemon_path = "./raadhus_daemon";
+static const char *layout_file = "raadhus.layout";
+static char test_layout[] = "/tmp/raadhus_loadtest.XXXXXX";
+static int frame_size;
+static int frames = 1000;
+static double fps = 20;
+static int burst = 1;
+static int parts;
+static double linger = 2;
+
+/* When each frame was sent and first seen on the way to the LEDs */
+static struct timespec *sent, *shown;
+static volatile int receiving = 1;
+
+static long long diff_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+static void add_ns(struct timespec *t, long long ns)
+{
+	ns += t->tv_nsec;
+	t->tv_sec += ns / 1000000000LL;
+	t->tv_nsec = ns % 1000000000LL;
+}
+
+/* Copies the layout without the color correction and returns the frame size */
+static int copy_layout(void)
+{
+	FILE *in, *out;
+	char line[1024], word[32];
+	int fd, width, height, size = 0;
+
+	if (!(in = fopen(layout_file, "r"))) {
+		perror(layout_file);
+		return -1;
+	}
+	if ((fd = mkstemp(test_layout)) < 0 || !(out = fdopen(fd, "w"))) {
+		perror(test_layout);
+		fclose(in);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), in)) {
+		if (sscanf(line, " frame %d %d", &width, &height) == 2) {
+			size = width * height * 3;
+		}
+		if (sscanf(line, " %31s", word) == 1 &&
+		    (!strcmp(word, "gamma") || !strcmp(word, "brightness") ||
+		     !strcmp(word, "balance"))) {
+			continue;
+		}
+		fputs(line, out);
+	}
+	fclose(in);
+	fclose(out);
+
+	if (!size) {
+		fprintf(stderr, "%s: no frame size\n", layout_file);
+		return -1;
+	}
+	return size;
+}
+
+static pid_t start_daemon(char *args[], int arg_count)
+{
+	char *argv[MAX_DAEMON_ARGS + 8];
+	int i, n = 0;
+	pid_t pid;
+
+	argv[n++] = (char *)daemon_path;
+	argv[n++] = "-i";
+	argv[n++] = "127.0.0.1";
+	argv[n++] = "-l";
+	argv[n++] = test_layout;
+	for (i = 0; i < arg_count && i < MAX_DAEMON_ARGS; i++) {
+		argv[n++] = args[i];
+	}
+	argv[n] = NULL;
+
+	if ((pid = fork()) == 0) {
+		execv(daemon_path, argv);
+		perror(daemon_path);
+		_exit(127);
+	}
+	return pid;
+}
+
+static int led_socket(void)
+{
+	struct sockaddr_in addr;
+	struct ip_mreq mreq;
+	struct timeval timeout = { 0, 100000 };
+	int sockd, one = 1;
+
+	if ((sockd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		return -1;
+	}
+	setsockopt(sockd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(sockd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(MC_PORT);
+	if (bind(sockd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		return -1;
+	}
+
+	mreq.imr_multiaddr.s_addr = inet_addr(MC_GROUP);
+	mreq.imr_interface.s_addr = inet_addr("127.0.0.1");
+	if (setsockopt(sockd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+		return -1;
+	}
+	return sockd;
+}
+
+/*
+  Returns the frame shown by a packet to the LEDs, from the first lit LED
+  of its first port, or -1 if it is black
+ */
+static int decode_frame(const unsigned char *packet, ssize_t size)
+{
+	int i, length;
+
+	if (size < LED_DATA || memcmp(packet, "YTKJ", 4)) {
+		return -1;
+	}
+	length = packet[LED_DATA - 2] | packet[LED_DATA - 1] << 8;
+	if (length > size - LED_DATA) {
+		length = size - LED_DATA;
+	}
+	for (i = LED_DATA; i + 3 <= LED_DATA + length; i += 3) {
+		if (packet[i + 2] & 0x80) {
+			return packet[i] | packet[i + 1] << 8 | (packet[i + 2] & 0x7f) << 16;
+		}
+	}
+	return -1;
+}
+
+static void *led_thread(void *data)
+{
+	int sockd = *(int *)data;
+	unsigned char packet[65536];
+	struct timespec now;
+	ssize_t size;
+
+	while (receiving) {
+		int n;
+		if ((size = recv(sockd, packet, sizeof(packet), 0)) < 0) {
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((n = decode_frame(packet, size)) >= 0 && n < frames &&
+		    !shown[n].tv_sec && !shown[n].tv_nsec) {
+			shown[n] = now;
+		}
+	}
+
+	return NULL;
+}
+
+/* Sends a frame whole, or in uncompressed parts with -P */
+static void send_frame(int sockd, const struct sockaddr_in *dest,
+		       unsigned char *frame, int n)
+{
+	struct raadhus_header header;
+	struct iovec iov[2];
+	struct msghdr msg;
+	int offset, length;
+
+	if (!parts) {
+		sendto(sockd, frame, frame_size, 0, (const struct sockaddr *)dest,
+		       sizeof(*dest));
+		return;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = (void *)dest;
+	msg.msg_namelen = sizeof(*dest);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	header.magic = htonl(RAADHUS_MAGIC);
+	header.frame = htonl(n);
+	header.size = htonl(frame_size);
+	header.flags = 0;
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+
+	for (offset = 0; offset < frame_size; offset += length) {
+		length = frame_size - offset < RAADHUS_MAX_PART ?
+			frame_size - offset : RAADHUS_MAX_PART;
+		header.offset = htonl(offset);
+		header.length = htons(length);
+		iov[1].iov_base = frame + offset;
+		iov[1].iov_len = length;
+		sendmsg(sockd, &msg, 0);
+	}
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(const struct timespec *start, const struct rusage *usage)
+{
+	long long *latency = malloc(frames * sizeof(*latency));
+	struct timespec first = { 0, 0 }, last = { 0, 0 };
+	int i, count = 0, reordered = 0, previous = -1;
+	double cpu_ms;
+
+	for (i = 0; i < frames; i++) {
+		if (!shown[i].tv_sec && !shown[i].tv_nsec) {
+			continue;
+		}
+		latency[count++] = diff_ns(&shown[i], &sent[i]);
+		if (!first.tv_sec || diff_ns(&shown[i], &first) < 0) {
+			first = shown[i];
+		}
+		if (diff_ns(&shown[i], &last) > 0) {
+			last = shown[i];
+		}
+		if (previous >= 0 && diff_ns(&shown[i], &shown[previous]) < 0) {
+			reordered++;
+		}
+		previous = i;
+	}
+
+	printf("sent %d frames of %d bytes at %.1f fps in bursts of %d%s in %.2f s\n",
+	       frames, frame_size, fps, burst, parts ? " as parts" : "",
+	       diff_ns(&sent[frames - 1], start) / 1e9);
+	printf("shown %d, dropped %d, out of order %d, %.1f fps\n", count,
+	       frames - count, reordered,
+	       count > 1 ? (count - 1) / (diff_ns(&last, &first) / 1e9) : 0.0);
+
+	if (count) {
+		qsort(latency, count, sizeof(*latency), compare_ll);
+		printf("latency ms: min %.2f p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+		       latency[0] / 1e6, latency[count / 2] / 1e6,
+		       latency[count * 9 / 10] / 1e6, latency[count * 99 / 100] / 1e6,
+		       latency[count - 1] / 1e6);
+	}
+
+	cpu_ms = (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1e3 +
+		(usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1e3;
+	printf("daemon cpu: %.1f ms user, %.1f ms system, %.3f ms per frame sent, "
+	       "%.3f ms per frame shown\n",
+	       usage->ru_utime.tv_sec * 1e3 + usage->ru_utime.tv_usec / 1e3,
+	       usage->ru_stime.tv_sec * 1e3 + usage->ru_stime.tv_usec / 1e3,
+	       cpu_ms / frames, count ? cpu_ms / count : 0.0);
+
+	free(latency);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in dest;
+	struct timespec start, deadline;
+	struct rusage usage;
+	unsigned char *frame;
+	pthread_t tid;
+	pid_t pid;
+	int sockd, led_sockd, opt, status, n;
+
+	while ((opt = getopt(argc, argv, "b:d:l:n:Pr:w:")) != -1) {
+		switch (opt) {
+		case 'b':
+			burst = atoi(optarg);
+			break;
+		case 'd':
+			daemon_path = optarg;
+			break;
+		case 'l':
+			layout_file = optarg;
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 'P':
+			parts = 1;
+			break;
+		case 'r':
+			fps = atof(optarg);
+			break;
+		case 'w':
+			linger = atof(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (frames < 1 || frames > 1 << 23 || fps <= 0 || burst < 1) {
+usage:
+		fprintf(stderr, "Usage: %s [-b burst] [-d daemon] [-l layout] [-n frames] "
+			"[-P] [-r fps] [-w seconds] [-- daemon options]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if ((frame_size = copy_layout()) < 0) {
+		return EXIT_FAILURE;
+	}
+	frame = malloc(frame_size);
+	sent = calloc(frames, sizeof(*sent));
+	shown = calloc(frames, sizeof(*shown));
+
+	if ((led_sockd = led_socket()) < 0) {
+		perror("failed to join the LED multicast group");
+		return EXIT_FAILURE;
+	}
+	sockd = socket(AF_INET, SOCK_DGRAM, 0);
+	dest.sin_family = AF_INET;
+	dest.sin_addr.s_addr = inet_addr("127.0.0.1");
+	dest.sin_port = htons(LISTEN_PORT);
+
+	pid = start_daemon(argv + optind, argc - optind);
+	pthread_create(&tid, NULL, led_thread, &led_sockd);
+	/* Time to read the layout and bind */
+	usleep(300000);
+
+	/* Bursts follow each other so the average rate is fps */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline = start;
+	for (n = 0; n < frames; n++) {
+		if (n && n % burst == 0) {
+			add_ns(&deadline, burst * 1e9 / fps);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+					       NULL) == EINTR)
+				;
+		}
+		for (opt = 0; opt < frame_size; opt += 3) {
+			frame[opt] = n;
+			frame[opt + 1] = n >> 8;
+			frame[opt + 2] = 0x80 | n >> 16;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &sent[n]);
+		send_frame(sockd, &dest, frame, n);
+	}
+
+	/* Whatever is still queued in the daemon */
+	usleep(linger * 1e6);
+	receiving = 0;
+	pthread_join(tid, NULL);
+
+	kill(pid, SIGTERM);
+	if (wait4(pid, &status, 0, &usage) < 0 ||
+	    (WIFEXITED(status) && WEXITSTATUS(status))) {
+		fprintf(stderr, "%s did not run\n", daemon_path);
+		unlink(test_layout);
+		return EXIT_FAILURE;
+	}
+	unlink(test_layout);
+
+	report(&start, &usage);
+	return 0;
+}
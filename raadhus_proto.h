@@ -0,0 +1,102 @@
+#ifndef _RAADHUS_PROTO_H_
+#define _RAADHUS_PROTO_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+  Frames for raadhus_daemon can be sent in parts small enough to fit in a
+  single datagram on the network, so losing one does not need IP
+  fragmentation to throw away the whole frame. Each part starts with this
+  header with all fields in network byte order. A datagram without it is
+  taken as a whole frame, like it always has been.
+ */
+#define RAADHUS_MAGIC 0x52414448	/* "RADH" */
+
+struct raadhus_header {
+	uint32_t magic;
+	/* Increases by one for each frame */
+	uint32_t frame;
+	/* Size of the whole frame */
+	uint32_t size;
+	/* Where the part goes in the frame and how long it is */
+	uint32_t offset;
+	uint16_t length;
+	uint16_t flags;
+};
+
+/*
+  Flags of a part. Without any, the part is length bytes of the frame as
+  they are.
+
+  With RAADHUS_RLE the bytes are run-length coded, so the part can be
+  shorter than length. Each run starts with a count byte c: below 128 it
+  is followed by c + 1 bytes to copy, otherwise by one byte to repeat
+  c - 125 times.
+
+  With RAADHUS_DELTA the bytes are XORed onto the same bytes of the
+  previous frame, which must have been complete. Mostly unchanged frames
+  become long runs of zeros which RLE codes in next to nothing. Frames
+  without it are keyframes, which a sender should send now and then, so
+  a receiver gets back on track after losing a frame.
+ */
+#define RAADHUS_RLE 0x0001
+#define RAADHUS_DELTA 0x0002
+
+#define RAADHUS_RLE_MAX_LITERAL 128
+#define RAADHUS_RLE_MAX_REPEAT 130
+/* Room which always holds length bytes run-length coded */
+#define RAADHUS_RLE_WORST_CASE(length) \
+	((length) + (length) / RAADHUS_RLE_MAX_LITERAL + 1)
+
+/* Largest part which fits in a 1500 byte MTU together with the headers */
+#define RAADHUS_MAX_PART (1472 - sizeof(struct raadhus_header))
+
+/*
+  Run-length codes as much of in as fits in size bytes of out. Returns the
+  number of bytes written to out and sets *used to the number of bytes of
+  in they code, which is all of them if size is at least
+  RAADHUS_RLE_WORST_CASE(length). Shared by the senders and the daemon's
+  capture files, so both code frames the same way
+ */
+static inline int raadhus_rle_encode(const unsigned char *in, int length,
+				     unsigned char *out, int size, int *used)
+{
+	int i = 0, o = 0;
+
+	while (i < length) {
+		int run = 1, n = 0;
+		while (i + run < length && run < RAADHUS_RLE_MAX_REPEAT &&
+		       in[i + run] == in[i]) {
+			run++;
+		}
+		if (run >= 3) {
+			if (o + 2 > size) {
+				break;
+			}
+			out[o++] = run + 125;
+			out[o++] = in[i];
+			i += run;
+			continue;
+		}
+
+		/* Copy bytes up to the next run worth repeating */
+		while (i + n < length && n < RAADHUS_RLE_MAX_LITERAL && o + n + 2 <= size &&
+		       !(i + n + 2 < length && in[i + n] == in[i + n + 1] &&
+			 in[i + n] == in[i + n + 2])) {
+			n++;
+		}
+		if (!n) {
+			break;
+		}
+		out[o++] = n - 1;
+		memcpy(out + o, in + i, n);
+		o += n;
+		i += n;
+	}
+
+	*used = i;
+	return o;
+}
+
+#endif	/* _RAADHUS_PROTO_H_ */
@@ -0,0 +1,94 @@
+#ifndef _RAADHUS_YTKJ_H_
+#define _RAADHUS_YTKJ_H_
+
+#include <string.h>
+
+/*
+  Reference decoder for the packets to the LED controllers, written from
+  the protocol as described in java-debug/SimpleTouch.java rather than
+  from the daemon's encoder, to check the encoder against. It is meant to
+  be obviously right, not fast.
+
+  All numbers are 16 bits, little endian. A packet holds one or more
+  chunks of at most 1472 bytes. Each starts with "YTKJ", the controller
+  id, two unknown bytes (0x57 0x05) and the number of port entries in the
+  chunk. Each entry is a channel, the number of bytes that follow and the
+  bytes. Each port has 2048 channels, so port n starts at channel n * 2048.
+  A port too long for a chunk goes on in an entry of the next one, from
+  the channel it got to. Every chunk but the first follows 8 bytes of zeros
+  where a UDP header would be, which the controllers skip.
+ */
+#define YTKJ_PORTS 8
+#define YTKJ_CHANNELS_PER_PORT 2048
+#define YTKJ_HEADER 10
+#define YTKJ_ENTRY 4
+#define YTKJ_DUMMY_HEADER 8
+
+struct ytkj_ports {
+	int id;
+	int chunks;
+	/* What each port was sent, and up to which channel */
+	unsigned char channels[YTKJ_PORTS][YTKJ_CHANNELS_PER_PORT];
+	int count[YTKJ_PORTS];
+};
+
+static int ytkj_le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+/*
+  Decodes a packet into what each port of the controller is sent. A packet
+  which ends early, like the daemon's do by the size of their dummy
+  headers, is decoded as far as it goes. Returns the number of LED bytes
+  decoded, or -1 if it is not a packet for a controller
+ */
+static int ytkj_decode(const unsigned char *packet, int size, struct ytkj_ports *ports)
+{
+	int offset = 0, total = 0;
+
+	memset(ports, 0, sizeof(*ports));
+	while (offset < size) {
+		int i, entries;
+
+		if (ports->chunks) {
+			offset += YTKJ_DUMMY_HEADER;
+		}
+		if (size - offset < YTKJ_HEADER) {
+			break;
+		}
+		if (memcmp(packet + offset, "YTKJ", 4) ||
+		    (ports->chunks && ytkj_le16(packet + offset + 4) != ports->id)) {
+			return -1;
+		}
+		ports->id = ytkj_le16(packet + offset + 4);
+		entries = ytkj_le16(packet + offset + 8);
+		offset += YTKJ_HEADER;
+		ports->chunks++;
+
+		for (i = 0; i < entries && size - offset >= YTKJ_ENTRY; i++) {
+			int channel = ytkj_le16(packet + offset);
+			int length = ytkj_le16(packet + offset + 2);
+			int port = channel / YTKJ_CHANNELS_PER_PORT;
+			int start = channel % YTKJ_CHANNELS_PER_PORT;
+
+			offset += YTKJ_ENTRY;
+			if (port >= YTKJ_PORTS || start + length > YTKJ_CHANNELS_PER_PORT) {
+				return -1;
+			}
+			if (length > size - offset) {
+				length = size - offset;
+			}
+			memcpy(&ports->channels[port][start], packet + offset, length);
+			if (start + length > ports->count[port]) {
+				ports->count[port] = start + length;
+			}
+			offset += length;
+			total += length;
+		}
+	}
+
+	return ports->chunks ? total : -1;
+}
+
+#endif	/* _RAADHUS_YTKJ_H_ */
@@ -0,0 +1,25 @@
+/* Blends the outgoing and the incoming shader of a transition */
+uniform sampler2D outgoing;
+uniform sampler2D incoming;
+uniform sampler2D mask;
+uniform vec2 resolution;
+uniform float progress;
+uniform int mode;
+
+void main(void)
+{
+  vec2 uv = gl_FragCoord.xy / resolution;
+  float t;
+
+  if (mode == 1) {
+    /* Wipe from the left with an edge a few pixels wide */
+    t = clamp((progress * (resolution.x + 4.0) - gl_FragCoord.x) / 4.0, 0.0, 1.0);
+  } else if (mode == 2) {
+    /* Each pixel comes in as the progress passes its mask */
+    t = clamp((progress * 1.1 - texture2D(mask, uv).r) / 0.1, 0.0, 1.0);
+  } else {
+    t = progress;
+  }
+
+  gl_FragColor = mix(texture2D(outgoing, uv), texture2D(incoming, uv), t);
+}
@@ -0,0 +1,210 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "effects.h"
+
+/*
+  The effects work on LANES pixels of a row at once with the vector
+  extensions of gcc, which become SSE, AVX or NEON instructions depending
+  on what the compiler may use, see the Makefile
+*/
+#ifdef __AVX__
+#define LANES 8
+#else
+#define LANES 4
+#endif
+#define PI 3.14159265358979f
+
+typedef float vfloat __attribute__((vector_size(LANES * sizeof(float))));
+typedef int32_t vint __attribute__((vector_size(LANES * sizeof(int32_t))));
+
+static int width, height;
+
+/* Rows are split between this many threads, the caller being one of them */
+static struct {
+	const struct effect *effect;
+	unsigned char *frame;
+	float time;
+	int threads;
+	pthread_barrier_t start, done;
+} job;
+
+static vfloat vselect(vint mask, vfloat a, vfloat b) {
+	return (vfloat)((mask & (vint)a) | (~mask & (vint)b));
+}
+
+static vfloat vabs(vfloat x) {
+	return (vfloat)((vint)x & 0x7fffffff);
+}
+
+static vfloat vmax(vfloat a, vfloat b) {
+	return vselect(a > b, a, b);
+}
+
+static vfloat vsqrt(vfloat x) {
+	int i;
+
+	for(i = 0; i < LANES; i++) {
+		x[i] = sqrtf(x[i]);
+	}
+	return x;
+}
+
+/* Good to about 1e-5, far better than the 8 bits we send */
+static vfloat vsin(vfloat x) {
+	vfloat x2, k = x * (1 / (2 * PI));
+
+	/* Round to the nearest turn and fold into -pi/2 to pi/2 */
+	k = (k + 12582912.0f) - 12582912.0f;
+	x -= k * (2 * PI);
+	x = vselect(x > PI / 2, PI - x, x);
+	x = vselect(x < -PI / 2, -PI - x, x);
+
+	x2 = x * x;
+	return x * (1 + x2 * (-1 / 6.0f + x2 * (1 / 120.0f +
+		x2 * (-1 / 5040.0f + x2 * (1 / 362880.0f)))));
+}
+
+/* Like atan(y, x) in GLSL, good to about 1e-6 */
+static vfloat vatan2(vfloat y, vfloat x) {
+	vfloat ax = vabs(x), ay = vabs(y);
+	vfloat a = vselect(ay > ax, ax, ay) / vmax(vmax(ax, ay), ax * 0 + 1e-30f);
+	vfloat s = a * a;
+	vfloat r = a + a * s * (-0.3333314528f + s * (0.1999355085f +
+		s * (-0.1420889944f + s * (0.1065626393f + s * (-0.0752896400f +
+		s * (0.0429096138f + s * (-0.0161657367f + s * 0.0028662257f)))))));
+
+	r = vselect(ay > ax, PI / 2 - r, r);
+	r = vselect(x < 0, PI - r, r);
+	return vselect(y < 0, -r, r);
+}
+
+/*
+  The colored ring of aske.glsl and aske2.glsl, averaged over RING_SAMPLES
+  squared points of each pixel like their ANTIALIAS
+*/
+#define RING_SAMPLES 3
+#define RING_CENTER_X 15
+#define RING_CENTER_Y 29
+#define RING_COLUMNS 54
+
+static void render_ring(const struct effect *effect, unsigned char *frame,
+			int first_row, int last_row, float t) {
+	const float step = 1.0f / RING_SAMPLES;
+	const float scale = 255.0f / (RING_SAMPLES * RING_SAMPLES);
+	int x, y, i, sx, sy;
+
+	for(y = first_row; y < last_row; y++) {
+		unsigned char *row = frame + y * width * 3;
+
+		for(x = 0; x < width; x += LANES) {
+			vfloat red = {0}, green = {0}, blue = {0}, column;
+			vint outside;
+
+			for(i = 0; i < LANES; i++) {
+				column[i] = x + i;
+			}
+
+			for(sy = 0; sy < RING_SAMPLES; sy++) {
+				vfloat cy = red * 0 + (y + (sy + 0.5f) * step - RING_CENTER_Y);
+				for(sx = 0; sx < RING_SAMPLES; sx++) {
+					vfloat cx = column + ((sx + 0.5f) * step - RING_CENTER_X);
+					vfloat a = vatan2(cx, cy);
+					vfloat r = vsqrt(cx * cx + cy * cy);
+					vfloat r0 = effect->radius + 3 * vsin(3 * a + t * 1.3f) +
+						3 * vsin(3 * a + t * 3.7f);
+					vfloat d = r - r0;
+					vfloat intensity = vmax(1 - d * d * 0.02f, red * 0);
+
+					red += intensity * (vsin(2 * a + t) * 0.5f + 0.5f);
+					green += intensity * (vsin(3 * a + t) * 0.5f + 0.5f);
+					blue += intensity * (vsin(7 * a + t) * 0.5f + 0.5f);
+				}
+			}
+
+			outside = column >= RING_COLUMNS;
+			red = vselect(outside, red * 0, red);
+			green = vselect(outside, green * 0, green);
+			blue = vselect(outside, blue * 0, blue);
+
+			for(i = 0; i < LANES && x + i < width; i++) {
+				row[(x + i) * 3] = red[i] * scale + 0.5f;
+				row[(x + i) * 3 + 1] = green[i] * scale + 0.5f;
+				row[(x + i) * 3 + 2] = blue[i] * scale + 0.5f;
+			}
+		}
+	}
+}
+
+/* Used in shaders.conf as @name */
+static const struct effect effects[] = {
+	{ "aske", render_ring, 20.0f },
+	{ "aske2", render_ring, 5.0f },
+};
+
+static void render_rows(int n) {
+	job.effect->render(job.effect, job.frame, n * height / job.threads,
+			   (n + 1) * height / job.threads, job.time);
+}
+
+static void *effect_thread(void *data) {
+	int n = (intptr_t)data;
+
+	for(;;) {
+		pthread_barrier_wait(&job.start);
+		render_rows(n);
+		pthread_barrier_wait(&job.done);
+	}
+
+	return NULL;
+}
+
+int init_effects(int frame_width, int frame_height, int threads) {
+	pthread_t tid;
+	int i;
+
+	width = frame_width;
+	height = frame_height;
+	job.threads = threads < 1 ? 1 : threads;
+
+	if(job.threads > 1) {
+		pthread_barrier_init(&job.start, NULL, job.threads);
+		pthread_barrier_init(&job.done, NULL, job.threads);
+		for(i = 1; i < job.threads; i++) {
+			if(pthread_create(&tid, NULL, effect_thread, (void *)(intptr_t)i)) {
+				perror("failed to start effect thread");
+				return -1;
+			}
+			pthread_detach(tid);
+		}
+	}
+
+	return 0;
+}
+
+int find_effect(const char *name) {
+	int i;
+
+	for(i = 0; i < sizeof(effects) / sizeof(effects[0]); i++) {
+		if(!strcmp(effects[i].name, name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void render_effect(int effect, unsigned char *frame, float time) {
+	job.effect = &effects[effect];
+	job.frame = frame;
+	job.time = time;
+
+	if(job.threads > 1) {
+		pthread_barrier_wait(&job.start);
+	}
+	render_rows(0);
+	if(job.threads > 1) {
+		pthread_barrier_wait(&job.done);
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef _EFFECTS_H_
+#define _EFFECTS_H_
+
+/*
+  Effects drawn on the CPU straight into frames of RGB bytes, bottom row
+  first like glReadPixels gives them, for boxes without OpenGL
+*/
+struct effect {
+	const char *name;
+	void (*render)(const struct effect *effect, unsigned char *frame,
+		       int first_row, int last_row, float time);
+	float radius;
+};
+
+int init_effects(int width, int height, int threads);
+int find_effect(const char *name);
+void render_effect(int effect, unsigned char *frame, float time);
+
+#endif	/* _EFFECTS_H_ */
@@ -0,0 +1,61 @@
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <stdio.h>
+
+/*
+  Headless rendering without a window system. We get an OpenGL context from
+  EGL with a tiny pbuffer to make it current with, and draw into the frame
+  buffer object set up by the caller. Mesa on the surfaceless platform needs
+  neither X nor a GPU, llvmpipe does the rendering.
+*/
+int init_headless(void) {
+	static const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_NONE
+	};
+	static const EGLint pbuffer_attribs[] = {
+		EGL_WIDTH, 1,
+		EGL_HEIGHT, 1,
+		EGL_NONE
+	};
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLConfig config;
+	EGLSurface surface;
+	EGLContext context;
+	EGLint count;
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+	display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+#endif
+	if(display == EGL_NO_DISPLAY) {
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+	if(display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+		fprintf(stderr, "failed to initialize EGL\n");
+		return -1;
+	}
+
+	if(!eglChooseConfig(display, config_attribs, &config, 1, &count) || count < 1) {
+		fprintf(stderr, "no EGL config for OpenGL pbuffers\n");
+		return -1;
+	}
+
+	if(!eglBindAPI(EGL_OPENGL_API)) {
+		fprintf(stderr, "EGL does not do OpenGL\n");
+		return -1;
+	}
+
+	surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+	context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+	if(surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT ||
+	   !eglMakeCurrent(display, surface, surface, context)) {
+		fprintf(stderr, "failed to create EGL context: 0x%x\n", eglGetError());
+		return -1;
+	}
+
+	return 0;
+}
@@ -1,15 +1,25 @@
+#define _GNU_SOURCE
 #include <GL/glut.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/types.h>
+#include <sys/inotify.h>
 #include <sys/socket.h>
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "util.h"
+#include "effects.h"
+#include "../raadhus_proto.h"
 
+int init_headless(void);
 void init_osaa(void);
 void draw_osaa(void);
 void idle_func(void);
@@ -17,38 +27,203 @@ void draw(void);
 void key_handler(unsigned char key, int x, int y);
 void mouse_handler(int x, int y);
 int read_shaders(const char *filename);
+void build_shaders(void);
+void check_watch(void);
 
+#define SHADERS_FILE "shaders.conf"
+#define WALLS_FILE "walls.conf"
+/*
+  Size of the wall, and of the canvas when there is no WALLS_FILE. The
+  fade through black takes SCREEN_WIDTH frames each way
+*/
 #define SCREEN_WIDTH 56
+#define SCREEN_HEIGHT 57
+/* The window shows the frames scaled up by this */
+#define PREVIEW_SCALE 8
 #define MAX_SHADERS 128
 
 /*
-  We set the frame time to 49 ms, which roughly corresponds to 20.4 FPS.
-  The daemon should run 20 FPS thus we produce frames a bit faster than
-  the playback rate. This is ok since we would rather drop frames than
-  be short of frames
+  Frame N is drawn at the start plus N frame periods on the monotonic
+  clock, so the rate does not drift away from the daemon's, which sends
+  at the same FPS. Set with -f
 */
-#define FRAME_TIME 49
+#define FPS 20
+/* Where the frames go when there is no WALLS_FILE */
 #define DESTINATION_HOST "192.168.2.1"
 #define DESTINATION_PORT 1234
 
+/*
+  Frames are sent as run-length coded deltas against the previous frame,
+  unless started with -r. Every KEYFRAME_INTERVAL frames a whole frame is
+  sent, so the daemon recovers from lost frames within a second
+*/
+#define KEYFRAME_INTERVAL 20
+
+/*
+  Everything is drawn on a canvas which may span several walls. Each wall
+  is sent its own rectangle of it, counted from the bottom left corner
+  like OpenGL does, by the daemon at its address, see WALLS_FILE
+*/
+#define MAX_WALLS 16
+static int canvas_width = SCREEN_WIDTH;
+static int canvas_height = SCREEN_HEIGHT;
+/* Bytes of a frame of the whole canvas */
+static int frame_size;
+
+struct wall {
+	struct sockaddr_in address;
+	int x, y, width, height;
+	/* The rectangle cut out of the canvas, or the delta to send */
+	unsigned char *slice;
+	/* What the daemon was sent last, to send the delta against */
+	unsigned char *previous;
+};
+
+static struct wall walls[MAX_WALLS];
+static int wall_count;
+
+/*
+  Parts of all the walls are sent SEND_BATCH at a time with sendmmsg. Build
+  with -DNO_SENDMMSG if the C library does not have it
+*/
+#define SEND_BATCH 64
+static struct {
+	struct mmsghdr messages[SEND_BATCH];
+	struct iovec iov[SEND_BATCH][2];
+	struct raadhus_header headers[SEND_BATCH];
+	unsigned char coded[SEND_BATCH][RAADHUS_MAX_PART];
+	int count;
+} batch;
+
 float iGlobalTime;
+static float time_delta;
+/* Of the frame being drawn, counting from 0 */
+static int frame_number = -1;
+static long frame_period_ns = 1000000000L / FPS;
+static struct timespec schedule_start;
+
+/*
+  What to do about frames which are due already when we get to them,
+  after a slow frame or a stall. Skipping goes on with the frame due now,
+  catching up draws the missed ones as fast as it can, unless it is more
+  than MAX_CATCH_UP frames behind. Set with -p
+*/
+enum e_late_policy { LATE_SKIP, LATE_CATCH_UP };
+static enum e_late_policy late_policy = LATE_SKIP;
+#define MAX_CATCH_UP 10
+
+/* Set by SIGUSR1 to have idle_func print the statistics of the schedule */
+static volatile sig_atomic_t dump_stats;
+
+static struct {
+	unsigned long frames;
+	unsigned long late;
+	unsigned long skipped;
+	/* How late the frames were started, in ns */
+	long long jitter_sum;
+	long long jitter_max;
+} schedule_stats;
 static int sockd;
+static int compress_frames = 1;
+static int headless;
+static int use_gl = 1;
+static int effect_threads = 1;
+static GLuint framebuffer;
 
-enum e_shader_type { REAL_SHADER, GL_CODE };
+/*
+  Frames are read back through a ring of pixel buffer objects. A frame is
+  mapped a frame after it was read into its buffer, when the copy is long
+  done, so we never wait for the GPU to finish drawing
+*/
+#define PBO_COUNT 2
+static GLuint pbos[PBO_COUNT];
+static unsigned int frames_read;
 
+/*
+  Frames waiting to be sent by sender_thread. If it falls behind, the
+  oldest frame is thrown away
+*/
+#define SEND_QUEUE_SIZE 4
 static struct {
-	float time;
+	unsigned char *frames[SEND_QUEUE_SIZE];
+	int head, count;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} send_queue;
+
+enum e_shader_type { REAL_SHADER, GL_CODE, CPU_EFFECT };
+
+/* How a shader hands over to the next one, see draw_transition */
+enum e_transition { FADE, CROSSFADE, WIPE, MASK };
+
+/*
+  GLSL programs are built when first needed, and built again when their
+  file changes, see build_shaders
+*/
+struct shader {
+	/* How long it is shown */
+	int frames;
+	char filename[128];
 	unsigned int prog;
+	/* Being built to replace prog */
+	unsigned int next;
+	/* The file has changed since prog was built */
+	int stale;
+	/* Failed to build, not tried again until the file changes */
+	int broken;
 	enum e_shader_type type;
-} shaders[MAX_SHADERS];
+	enum e_transition transition;
+	/* Shader drawing the mask of a MASK transition */
+	char mask[128];
+	/* Uniforms of prog, -1 for those it does not use */
+	struct {
+		int global_time;
+		int resolution;
+		int frame;
+		int time_delta;
+		int local_time;
+		int transition;
+	} uniforms;
+};
 
+static struct shader shaders[MAX_SHADERS];
 static int shader_count;
+static int watch_fd = -1;
+
+unsigned int shader_program(struct shader *shader);
+static void init_watch(void);
 static int current_shader;
-static long shader_activated_time;
-static long next_frame_time;
+static int shader_activated_frame;
 static int transition_offset_x;
 static int transition_direction;
 
+/*
+  Transitions other than fading through black draw the outgoing and the
+  incoming shader into a layer each, and blend them with composite.glsl
+  while next_shader is set
+*/
+#define TRANSITION_FRAMES 40
+#define MAX_MASKS 16
+enum { OUTGOING, INCOMING, MASK_LAYER, LAYERS };
+
+static struct {
+	GLuint framebuffer;
+	GLuint texture;
+} layers[LAYERS];
+
+static struct {
+	unsigned int prog;
+	int resolution;
+	int progress;
+	int mode;
+} composite;
+
+static struct shader masks[MAX_MASKS];
+static int mask_count;
+static int next_shader = -1;
+static int transition_frame;
+static int transition_start;
+
 static int init_socket(void)
 {
 	struct sockaddr_in my_addr;
@@ -72,94 +247,703 @@ static int init_socket(void)
 	return 0;
 }
 
-static int send_packet(void *data, int size)
+/*
+  Reads where the frames go, see walls.conf. Without the file the whole
+  canvas goes to DESTINATION_HOST as it always has
+*/
+static int read_walls(const char *filename) {
+	FILE *fd = fopen(filename, "r");
+	char line[256], host[256];
+	int i, port, x, y, width, height, line_number = 0;
+	struct wall *wall;
+
+	if(!fd) {
+		if(errno != ENOENT) {
+			perror(filename);
+			return -1;
+		}
+		wall = &walls[wall_count++];
+		wall->address.sin_family = AF_INET;
+		wall->address.sin_addr.s_addr = inet_addr(DESTINATION_HOST);
+		wall->address.sin_port = htons(DESTINATION_PORT);
+		wall->width = canvas_width;
+		wall->height = canvas_height;
+	}
+
+	while(fd && fgets(line, sizeof(line), fd)) {
+		char *start = line + strspn(line, " \t");
+
+		line_number++;
+		if(*start == '#' || *start == '\n' || !*start) {
+			continue;
+		}
+		if(sscanf(start, "canvas %d %d", &width, &height) == 2 &&
+		   width > 0 && height > 0) {
+			canvas_width = width;
+			canvas_height = height;
+		} else if(sscanf(start, "wall %255s %d %d %d %d %d", host, &port,
+				  &x, &y, &width, &height) == 6 && wall_count < MAX_WALLS) {
+			wall = &walls[wall_count];
+			memset(wall, 0, sizeof(*wall));
+			wall->address.sin_family = AF_INET;
+			wall->address.sin_port = htons(port);
+			if(!inet_aton(host, &wall->address.sin_addr)) {
+				fprintf(stderr, "%s:%d: bad address %s\n", filename, line_number, host);
+				fclose(fd);
+				return -1;
+			}
+			wall->x = x;
+			wall->y = y;
+			wall->width = width;
+			wall->height = height;
+			wall_count++;
+		} else {
+			fprintf(stderr, "%s:%d: cannot make sense of %s", filename, line_number, start);
+			fclose(fd);
+			return -1;
+		}
+	}
+	if(fd) {
+		fclose(fd);
+	}
+
+	if(!wall_count) {
+		fprintf(stderr, "no walls in %s\n", filename);
+		return -1;
+	}
+
+	for(i = 0; i < wall_count; i++) {
+		wall = &walls[i];
+		if(wall->width <= 0 || wall->height <= 0 || wall->x < 0 || wall->y < 0 ||
+		   wall->x + wall->width > canvas_width || wall->y + wall->height > canvas_height) {
+			fprintf(stderr, "wall %d of %s is not on the %dx%d canvas\n",
+				i + 1, filename, canvas_width, canvas_height);
+			return -1;
+		}
+		wall->slice = malloc(wall->width * wall->height * 3);
+		wall->previous = calloc(wall->width * wall->height, 3);
+	}
+	frame_size = canvas_width * canvas_height * 3;
+
+	return 0;
+}
+
+/* Sends the parts in the batch, and empties it */
+static int flush_batch(void) {
+	int sent = 0, ret = 0;
+
+#ifdef NO_SENDMMSG
+	for(; sent < batch.count; sent++) {
+		if(sendmsg(sockd, &batch.messages[sent].msg_hdr, 0) < 0) {
+			ret = -1;
+		}
+	}
+#else
+	while(sent < batch.count) {
+		int n = sendmmsg(sockd, batch.messages + sent, batch.count - sent, 0);
+		if(n < 0) {
+			/* Give up on the one which failed and go on with the rest */
+			n = 1;
+			ret = -1;
+		}
+		sent += n;
+	}
+#endif
+
+	batch.count = 0;
+	return ret;
+}
+
+/*
+  Adds a part with as much of the size bytes of in as fits to the batch,
+  sending the batch first if it is full. Sets *length to the bytes it took
+*/
+static int batch_part(struct wall *wall, const struct raadhus_header *header,
+		      const unsigned char *in, int size, int flags, int *length) {
+	int n, ret = 0;
+	struct msghdr *msg;
+
+	if(batch.count == SEND_BATCH) {
+		ret = flush_batch();
+	}
+	n = batch.count;
+	msg = &batch.messages[n].msg_hdr;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name = &wall->address;
+	msg->msg_namelen = sizeof(wall->address);
+	msg->msg_iov = batch.iov[n];
+	msg->msg_iovlen = 2;
+
+	batch.headers[n] = *header;
+	batch.iov[n][0].iov_base = &batch.headers[n];
+	batch.iov[n][0].iov_len = sizeof(*header);
+
+	*length = size < RAADHUS_MAX_PART ? size : RAADHUS_MAX_PART;
+	if(flags & RAADHUS_RLE) {
+		/* The length field is 16 bits */
+		batch.iov[n][1].iov_len = raadhus_rle_encode(in, size < 65535 ? size : 65535,
+						     batch.coded[n], RAADHUS_MAX_PART, length);
+		batch.iov[n][1].iov_base = batch.coded[n];
+	} else {
+		batch.iov[n][1].iov_base = (void *)in;
+		batch.iov[n][1].iov_len = *length;
+	}
+	batch.headers[n].length = htons(*length);
+	batch.count++;
+
+	return ret;
+}
+
+/*
+  Sends each wall its rectangle of the canvas in parts which fit in a
+  datagram, see raadhus_proto.h. The walls all get the same frame number
+  and keyframes, so they stay in step. Only called from sender_thread
+*/
+static int send_frame(const unsigned char *canvas)
 {
-	struct sockaddr_in dest;
+	static uint32_t frame;
+	struct raadhus_header header;
+	int i, w, flags = 0, ret = 0;
+
+	if(compress_frames) {
+		flags = RAADHUS_RLE;
+		if(frame % KEYFRAME_INTERVAL) {
+			flags |= RAADHUS_DELTA;
+		}
+	}
+
+	header.magic = htonl(RAADHUS_MAGIC);
+	header.frame = htonl(frame++);
+	header.flags = htons(flags);
+
+	for(w = 0; w < wall_count; w++) {
+		struct wall *wall = &walls[w];
+		int size = wall->width * wall->height * 3;
+		const unsigned char *in = canvas;
+		int offset, length;
+
+		/* A wall showing all of the canvas is sent it as it is */
+		if(size != frame_size) {
+			for(i = 0; i < wall->height; i++) {
+				memcpy(wall->slice + i * wall->width * 3,
+				       canvas + ((wall->y + i) * canvas_width + wall->x) * 3,
+				       wall->width * 3);
+			}
+			in = wall->slice;
+		}
+
+		if(flags & RAADHUS_DELTA) {
+			for(i = 0; i < size; i++) {
+				unsigned char pixel = in[i];
+				wall->slice[i] = pixel ^ wall->previous[i];
+				wall->previous[i] = pixel;
+			}
+			in = wall->slice;
+		} else if(compress_frames) {
+			memcpy(wall->previous, in, size);
+		}
+
+		header.size = htonl(size);
+		for(offset = 0; offset < size; offset += length) {
+			header.offset = htonl(offset);
+			if(batch_part(wall, &header, in + offset, size - offset, flags, &length) < 0) {
+				ret = -1;
+			}
+		}
+	}
+
+	if(flush_batch() < 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+  Returns the frame after the last one queued, to fill in and pass on with
+  queue_frame. The sender does not touch it until then
+*/
+static unsigned char *reserve_frame(void) {
+	unsigned char *frame;
+
+	pthread_mutex_lock(&send_queue.lock);
+	if(send_queue.count == SEND_QUEUE_SIZE) {
+		send_queue.head = (send_queue.head + 1) % SEND_QUEUE_SIZE;
+		send_queue.count--;
+	}
+	frame = send_queue.frames[(send_queue.head + send_queue.count) % SEND_QUEUE_SIZE];
+	pthread_mutex_unlock(&send_queue.lock);
+
+	return frame;
+}
+
+static void queue_frame(void) {
+	static int first = 1;
+
+	if(first) {
+		fprintf(stderr, "first frame after %lu ms\n", get_msec());
+		first = 0;
+	}
+
+	pthread_mutex_lock(&send_queue.lock);
+	send_queue.count++;
+	pthread_cond_signal(&send_queue.cond);
+	pthread_mutex_unlock(&send_queue.lock);
+}
+
+static void *sender_thread(void *data) {
+	unsigned char *frame = malloc(frame_size);
+
+	for(;;) {
+		pthread_mutex_lock(&send_queue.lock);
+		while(!send_queue.count) {
+			pthread_cond_wait(&send_queue.cond, &send_queue.lock);
+		}
+		memcpy(frame, send_queue.frames[send_queue.head], frame_size);
+		send_queue.head = (send_queue.head + 1) % SEND_QUEUE_SIZE;
+		send_queue.count--;
+		pthread_mutex_unlock(&send_queue.lock);
+
+		send_frame(frame);
+	}
+
+	return NULL;
+}
+
+static void init_pbos(void) {
+	int i;
+
+	glGenBuffers(PBO_COUNT, pbos);
+	for(i = 0; i < PBO_COUNT; i++) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, frame_size, NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+static void queue_pbo(GLuint pbo) {
+	const unsigned char *pixels;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+	if((pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY))) {
+		memcpy(reserve_frame(), pixels, frame_size);
+		queue_frame();
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+/* Starts reading back the frame just drawn and queues the one before it */
+static void read_frame(void) {
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[frames_read % PBO_COUNT]);
+	glReadPixels(0, 0, canvas_width, canvas_height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	frames_read++;
+
+	/* The oldest buffer, once they have all been read into */
+	if(frames_read >= PBO_COUNT) {
+		queue_pbo(pbos[frames_read % PBO_COUNT]);
+	}
+}
+
+/* Queues the frames still being read back, oldest first */
+static void flush_frames(void) {
+	int i = frames_read < PBO_COUNT - 1 ? frames_read : PBO_COUNT - 1;
+
+	for(; i > 0; i--) {
+		queue_pbo(pbos[(frames_read - i) % PBO_COUNT]);
+	}
+	frames_read = 0;
+}
+
+/* Shows the frame in the frame buffer object scaled up in the window */
+static void show_frame(void) {
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, 0, canvas_width, canvas_height, 0, 0,
+			  glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT),
+			  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+	glutSwapBuffers();
+}
+
+/*
+  Effects drawn on the CPU go straight into the send queue, and only
+  into the frame buffer object to be shown in the window
+*/
+static void draw_effect(int effect) {
+	float fade = 1.0f - transition_offset_x / (float)SCREEN_WIDTH;
+	unsigned char *frame;
+	int i;
+
+	if(use_gl) {
+		flush_frames();
+	}
+
+	frame = reserve_frame();
+	render_effect(effect, frame, iGlobalTime);
+	if(transition_offset_x) {
+		for(i = 0; i < frame_size; i++) {
+			frame[i] = frame[i] * fade + 0.5f;
+		}
+	}
+
+	if(!headless) {
+		glWindowPos2i(0, 0);
+		glDrawPixels(canvas_width, canvas_height, GL_RGB, GL_UNSIGNED_BYTE, frame);
+		show_frame();
+	}
+
+	queue_frame();
+}
+
+/*
+  Everything is drawn into a frame buffer object of exactly the size of the
+  canvas, with or without a window, and the frames are read back from there.
+  Like the window it has no depth buffer, so the depth test does nothing.
+  Rows of pixels are packed, whatever the width of the canvas
+*/
+static int init_framebuffer(void) {
+	GLuint color;
+
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+	glGenRenderbuffers(1, &color);
+	glBindRenderbuffer(GL_RENDERBUFFER, color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, canvas_width, canvas_height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+
+	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		return -1;
+	}
+	glViewport(0, 0, canvas_width, canvas_height);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	return 0;
+}
+
+static int init_compositor(void) {
+	static const char *samplers[LAYERS] = { "outgoing", "incoming", "mask" };
+	int i;
+
+	for(i = 0; i < LAYERS; i++) {
+		glGenTextures(1, &layers[i].texture);
+		glBindTexture(GL_TEXTURE_2D, layers[i].texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, canvas_width, canvas_height, 0,
+			     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+		glGenFramebuffers(1, &layers[i].framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, layers[i].framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+				       layers[i].texture, 0);
+		if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			return -1;
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+	if(!(composite.prog = setup_shader("composite.glsl"))) {
+		return -1;
+	}
+	composite.resolution = glGetUniformLocationARB(composite.prog, "resolution");
+	composite.progress = glGetUniformLocationARB(composite.prog, "progress");
+	composite.mode = glGetUniformLocationARB(composite.prog, "mode");
+
+	/* The layers are always on the same texture units */
+	set_shader(composite.prog);
+	for(i = 0; i < LAYERS; i++) {
+		glUniform1i(glGetUniformLocationARB(composite.prog, samplers[i]), i);
+	}
+	glUniform2f(composite.resolution, canvas_width, canvas_height);
+	set_shader(0);
+
+	return 0;
+}
+
+static void on_sigusr1(int sig) {
+	dump_stats = 1;
+}
+
+static float frames_to_seconds(int frames) {
+	return frames * (frame_period_ns / 1e9f);
+}
+
+/*
+  Waits until the next frame is due, or finds it is late, and returns
+  the number of the frame to draw
+*/
+static int schedule_frame(void) {
+	int frame = frame_number + 1;
+	long long due = (long long)frame * frame_period_ns + schedule_start.tv_nsec;
+	struct timespec deadline, now;
+	long long late;
+
+	deadline.tv_sec = schedule_start.tv_sec + due / 1000000000LL;
+	deadline.tv_nsec = due % 1000000000LL;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+		;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	late = (now.tv_sec - deadline.tv_sec) * 1000000000LL + (now.tv_nsec - deadline.tv_nsec);
+	if(late >= frame_period_ns) {
+		long long missed = late / frame_period_ns;
+		schedule_stats.late++;
+		if(late_policy == LATE_SKIP || missed > MAX_CATCH_UP) {
+			frame += missed;
+			late -= missed * frame_period_ns;
+			schedule_stats.skipped += missed;
+		}
+	}
+
+	schedule_stats.frames++;
+	schedule_stats.jitter_sum += late;
+	if(late > schedule_stats.jitter_max) {
+		schedule_stats.jitter_max = late;
+	}
 
-	dest.sin_family = AF_INET;
-	dest.sin_addr.s_addr = inet_addr(DESTINATION_HOST);
-	dest.sin_port = htons (DESTINATION_PORT);
+	if(dump_stats) {
+		dump_stats = 0;
+		fprintf(stderr, "frames %lu late %lu skipped %lu jitter mean %.3f max %.3f ms\n",
+			schedule_stats.frames, schedule_stats.late, schedule_stats.skipped,
+			schedule_stats.jitter_sum / 1e6 / schedule_stats.frames,
+			schedule_stats.jitter_max / 1e6);
+	}
 
-	return sendto(sockd, data, size, 0, (struct sockaddr*)&dest, sizeof(dest));
+	return frame;
 }
 
 int main(int argc, char **argv) {
+	pthread_t tid;
+	int i;
+
+	/* Startup times are from here */
+	get_msec();
+
 	if(init_socket() < 0) {
 		perror("failed to init socket");
 		return -1;
 	}
-	
-	glutInitWindowSize(64, 60);
-	
-	/* initialize glut */
-	glutInit(&argc, argv);
-	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE);
-	glutCreateWindow("Raadhus Shader");
-
-	glutDisplayFunc(draw);
-	glutIdleFunc(idle_func);
-	glutKeyboardFunc(key_handler);
-	glutMotionFunc(mouse_handler);
-	
-	if(read_shaders("shaders.conf")) {
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-r")) {
+			/* Send raw frames to daemons which do not know the compressed format */
+			compress_frames = 0;
+		} else if(!strcmp(argv[i], "-H")) {
+			/* No window, e.g. on a server without a display */
+			headless = 1;
+		} else if(!strcmp(argv[i], "-n")) {
+			/* Only effects drawn on the CPU, for boxes without OpenGL */
+			use_gl = 0;
+			headless = 1;
+		} else if(!strcmp(argv[i], "-j") && i + 1 < argc) {
+			/* Threads to draw the effects with */
+			effect_threads = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "-f") && i + 1 < argc) {
+			double fps = atof(argv[++i]);
+			if(fps <= 0) {
+				fprintf(stderr, "bad frame rate: %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+			frame_period_ns = 1000000000.0 / fps;
+		} else if(!strcmp(argv[i], "-p") && i + 1 < argc) {
+			i++;
+			if(!strcmp(argv[i], "skip")) {
+				late_policy = LATE_SKIP;
+			} else if(!strcmp(argv[i], "catchup")) {
+				late_policy = LATE_CATCH_UP;
+			} else {
+				fprintf(stderr, "unknown policy for late frames: %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	signal(SIGUSR1, on_sigusr1);
+
+	if(read_walls(WALLS_FILE) < 0) {
 		return EXIT_FAILURE;
 	}
 
-	set_shader(shaders[current_shader].prog);
-	shader_activated_time = get_msec();
+	if(init_effects(canvas_width, canvas_height, effect_threads) < 0) {
+		return EXIT_FAILURE;
+	}
 
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	if(!use_gl) {
+		/* Nothing to set up */
+	} else if(headless) {
+		if(init_headless() < 0) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		glutInitWindowSize(canvas_width * PREVIEW_SCALE, canvas_height * PREVIEW_SCALE);
+
+		/* initialize glut */
+		glutInit(&argc, argv);
+		glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE);
+		glutCreateWindow("Raadhus Shader");
+
+		glutDisplayFunc(draw);
+		glutIdleFunc(idle_func);
+		glutKeyboardFunc(key_handler);
+		glutMotionFunc(mouse_handler);
+	}
+
+	if(use_gl) {
+		if(init_framebuffer() < 0) {
+			fprintf(stderr, "failed to set up the frame buffer object\n");
+			return EXIT_FAILURE;
+		}
+		init_pbos();
+		if(init_compositor() < 0) {
+			fprintf(stderr, "failed to set up the transitions\n");
+			return EXIT_FAILURE;
+		}
+	}
 
-	glEnable(GL_DEPTH_TEST);
+	if(read_shaders(SHADERS_FILE)) {
+		fprintf(stderr, "no shaders in %s\n", SHADERS_FILE);
+		return EXIT_FAILURE;
+	}
+	init_watch();
 
-	init_osaa();
+	for(i = 0; i < SEND_QUEUE_SIZE; i++) {
+		send_queue.frames[i] = malloc(frame_size);
+	}
+	pthread_mutex_init(&send_queue.lock, NULL);
+	pthread_cond_init(&send_queue.cond, NULL);
+	pthread_create(&tid, NULL, sender_thread, NULL);
+	pthread_detach(tid);
+
+	shader_activated_frame = 0;
+	clock_gettime(CLOCK_MONOTONIC, &schedule_start);
+
+	if(use_gl) {
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+		glEnable(GL_DEPTH_TEST);
+
+		init_osaa();
+	}
+
+	if(headless) {
+		for(;;) {
+			idle_func();
+			draw();
+		}
+	}
 
 	glutMainLoop();
 	return 0;
 }
 
 void idle_func(void) {
-	/* Check if we are going faster than the FRAME_TIME */
-	long current_time = get_msec();
-	long delta = next_frame_time - current_time;
-	if(delta > 0 && delta < FRAME_TIME) {
-		usleep(delta * 1000l);
-		next_frame_time += FRAME_TIME;
-	} else {
-		/* Seems we are too late or we just started. Just sync. */
-		next_frame_time = current_time + FRAME_TIME;
+	int frame, advance;
+
+	check_watch();
+	if(use_gl) {
+		build_shaders();
+	}
+
+	frame = schedule_frame();
+	/* More than one if frames were skipped */
+	advance = frame - frame_number;
+	frame_number = frame;
+
+	if(!headless) {
+		glutPostRedisplay();
 	}
-	glutPostRedisplay();
 
 	/* Check if we should go to the next shader or if we are transitioning */
-	if(transition_offset_x) {
-		transition_offset_x += transition_direction;
+	if(next_shader >= 0) {
+		if((transition_frame += advance) >= TRANSITION_FRAMES) {
+			current_shader = next_shader;
+			shader_activated_frame = transition_start;
+			next_shader = -1;
+		}
+	} else if(transition_offset_x) {
+		transition_offset_x += transition_direction * advance;
 		if(transition_offset_x >= SCREEN_WIDTH) {
 			/* Old shader is now shifted out. Switch shader and shift it in */
 			current_shader = (current_shader+1) % shader_count;
-			set_shader(shaders[current_shader].prog);
-			shader_activated_time = current_time;
+			shader_activated_frame = frame_number;
 
 			transition_offset_x = SCREEN_WIDTH;
 			transition_direction = -1;
 		} else if(transition_offset_x <= 0) {
+			transition_offset_x = 0;
 			transition_direction = 0;
 		}
-	} else if(shaders[current_shader].time + shader_activated_time < current_time) {
-		transition_offset_x = 1;
-		transition_direction = 1;
+	} else if(frame_number - shader_activated_frame >= shaders[current_shader].frames) {
+		if(use_gl && shaders[current_shader].transition != FADE) {
+			next_shader = (current_shader+1) % shader_count;
+			transition_frame = 0;
+			transition_start = frame_number;
+		} else {
+			transition_offset_x = 1;
+			transition_direction = 1;
+		}
 	}
 }
 
-void draw(void) {
-	unsigned char pixels[SCREEN_WIDTH * 60 * 3];
-	unsigned int prog = shaders[current_shader].prog;
+/*
+  Sets what the shader uses of the uniforms it can get, much like on
+  Shadertoy:
 
-	iGlobalTime = get_msec() / 1000.0f;
+  iGlobalTime  seconds since the start
+  iResolution  size of the wall in pixels, the third component is 1
+  iFrame       number of the frame, counting from 0
+  iTimeDelta   seconds since the last frame
+  iLocalTime   seconds since this shader came on
+  iTransition  how far it is faded out, from 0 when showing to 1 at the
+               switch to the next shader, and back to 0 as the next one
+               comes in. Shaders using it do their own transitions and
+               are not faded to black
+*/
+static void set_uniforms(const struct shader *shader, float transition, int activated_frame) {
+	if(shader->uniforms.global_time != -1) {
+		glUniform1f(shader->uniforms.global_time, iGlobalTime);
+	}
+	if(shader->uniforms.resolution != -1) {
+		glUniform3f(shader->uniforms.resolution, canvas_width, canvas_height, 1.0f);
+	}
+	if(shader->uniforms.frame != -1) {
+		glUniform1i(shader->uniforms.frame, frame_number);
+	}
+	if(shader->uniforms.time_delta != -1) {
+		glUniform1f(shader->uniforms.time_delta, time_delta);
+	}
+	if(shader->uniforms.local_time != -1) {
+		glUniform1f(shader->uniforms.local_time,
+			    frames_to_seconds(frame_number - activated_frame));
+	}
+	if(shader->uniforms.transition != -1) {
+		glUniform1f(shader->uniforms.transition, transition);
+	}
+}
 
-	glDisable(GL_BLEND);		
+static void draw_quad(void) {
+	glBegin(GL_QUADS);
+	glTexCoord2f(0, 0);
+	glVertex2f(-1, -1);
+	glTexCoord2f(1, 0);
+	glVertex2f(1, -1);
+	glTexCoord2f(1, 1);
+	glVertex2f(1, 1);
+	glTexCoord2f(0, 1);
+	glVertex2f(-1, 1);
+	glEnd();
+}
+
+/* Draws the shader into the frame buffer object bound */
+static void draw_layer(struct shader *shader, float transition, int activated_frame) {
+	static unsigned char *frame;
+	unsigned int prog = shader->prog;
 
-	switch(shaders[current_shader].type) {
+	switch(shader->type) {
 	case GL_CODE:
 		switch(prog) {
 		case 1:
@@ -168,46 +952,127 @@ void draw(void) {
 		}
 		break;
 	case REAL_SHADER:
+		if(!(prog = shader_program(shader))) {
+			/* Black until it is fixed */
+			glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT);
+			break;
+		}
 		set_shader(prog);
-
-		set_uniform1f(prog, "iGlobalTime", iGlobalTime);
-
-		glBegin(GL_QUADS);
-		glTexCoord2f(0, 0);
-		glVertex2f(-1, -1);
-		glTexCoord2f(1, 0);
-		glVertex2f(1, -1);
-		glTexCoord2f(1, 1);
-		glVertex2f(1, 1);
-		glTexCoord2f(0, 1);
-		glVertex2f(-1, 1);
-		glEnd();
-		
+		set_uniforms(shader, transition, activated_frame);
+		draw_quad();
+		break;
+	case CPU_EFFECT:
+		if(!frame) {
+			frame = malloc(frame_size);
+		}
+		render_effect(prog, frame, iGlobalTime);
+		glWindowPos2i(0, 0);
+		glDrawPixels(canvas_width, canvas_height, GL_RGB, GL_UNSIGNED_BYTE, frame);
 		break;
 	}
 
 	set_shader(0);
-	glEnable(GL_BLEND);
+}
 
-	glColor4f(0.0f, 0.0f, 0.0f, transition_offset_x / (float)SCREEN_WIDTH);
+static struct shader *find_mask(const char *filename) {
+	struct shader *mask;
+	int i;
 
-	glBegin(GL_QUADS);
-	glTexCoord2f(0, 0);
-	glVertex2f(-1, -1);
-	glTexCoord2f(1, 0);
-	glVertex2f(1, -1);
-	glTexCoord2f(1, 1);
-	glVertex2f(1, 1);
-	glTexCoord2f(0, 1);
-	glVertex2f(-1, 1);
-	glEnd();
+	for(i = 0; i < mask_count; i++) {
+		if(!strcmp(masks[i].filename, filename)) {
+			break;
+		}
+	}
+	if(i == mask_count) {
+		if(mask_count == MAX_MASKS) {
+			return NULL;
+		}
+		mask = &masks[mask_count++];
+		memset(mask, 0, sizeof(*mask));
+		strcpy(mask->filename, filename);
+		mask->type = REAL_SHADER;
+	}
 
-	glutSwapBuffers();
+	return shader_program(&masks[i]) ? &masks[i] : NULL;
+}
+
+/*
+  Blends the outgoing and the incoming shader in composite.glsl. A
+  crossfade mixes them, a wipe shows the incoming one from the left and
+  a mask lets each pixel come in when the progress passes the value the
+  mask shader draws there, so darker pixels come in first
+*/
+static void draw_transition(struct shader *from, struct shader *to) {
+	float progress = transition_frame / (float)TRANSITION_FRAMES;
+	struct shader *mask = NULL;
+	int mode = 0, i;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, layers[OUTGOING].framebuffer);
+	draw_layer(from, progress, shader_activated_frame);
+	glBindFramebuffer(GL_FRAMEBUFFER, layers[INCOMING].framebuffer);
+	draw_layer(to, 1.0f - progress, transition_start);
 
-	memset(pixels, 0, SCREEN_WIDTH*60*3);
-	glReadPixels(0, 0, SCREEN_WIDTH, 60, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+	if(from->transition == WIPE) {
+		mode = 1;
+	} else if(from->transition == MASK && (mask = find_mask(from->mask))) {
+		glBindFramebuffer(GL_FRAMEBUFFER, layers[MASK_LAYER].framebuffer);
+		draw_layer(mask, progress, transition_start);
+		mode = 2;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
 
-	send_packet(pixels, sizeof(pixels));
+	for(i = 0; i < LAYERS; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, layers[i].texture);
+	}
+	set_shader(composite.prog);
+	glUniform1f(composite.progress, progress);
+	glUniform1i(composite.mode, mode);
+	draw_quad();
+	set_shader(0);
+	for(i = LAYERS - 1; i >= 0; i--) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+}
+
+void draw(void) {
+	struct shader *shader = &shaders[current_shader];
+	float fade = transition_offset_x / (float)SCREEN_WIDTH;
+	static int last_frame = -1;
+
+	/* Times follow the schedule rather than the clock, so motion stays even */
+	time_delta = last_frame < 0 ? 0.0f : frames_to_seconds(frame_number - last_frame);
+	iGlobalTime = frames_to_seconds(frame_number);
+	last_frame = frame_number;
+
+	if(shader->type == CPU_EFFECT && next_shader < 0) {
+		draw_effect(shader->prog);
+		return;
+	}
+
+	glDisable(GL_BLEND);		
+
+	if(next_shader >= 0) {
+		draw_transition(shader, &shaders[next_shader]);
+	} else {
+		draw_layer(shader, fade, shader_activated_frame);
+
+		if(shader->type == REAL_SHADER && shader->prog &&
+		   shader->uniforms.transition != -1) {
+			fade = 0.0f;
+		}
+		glEnable(GL_BLEND);
+		glColor4f(0.0f, 0.0f, 0.0f, fade);
+		draw_quad();
+	}
+
+	read_frame();
+
+	if(!headless) {
+		show_frame();
+	}
 }
 
 void key_handler(unsigned char key, int x, int y) {
@@ -227,46 +1092,256 @@ void mouse_handler(int x, int y) {
 #endif
 }
 
+/*
+  Reads the playlist. Shaders which were on the old one keep their
+  programs, the rest are built when needed. If the file is broken, the
+  old playlist stays as it is
+*/
 int read_shaders(const char *filename) {
 	/* If this gets more advanced we will switch to libconfuse,
 	   but right now we save that dependency */
-	int ret = 0;
+	static struct shader list[MAX_SHADERS];
 	FILE *fd = fopen(filename, "r");
 	char line[128];
-	shader_count = 0;
-	current_shader = 0;
-	transition_offset_x = 0;
+	int count = 0, i;
 
 	if(!fd) {
 		return -1;
 	}
 
-	while(shader_count < MAX_SHADERS && fgets(line, sizeof(line), fd)) {
-		float time;
-		char filename[sizeof(line)];
-		if(sscanf(line, "%f %s", &time, filename) == 2) {
-			unsigned int prog;
-			enum e_shader_type type = REAL_SHADER;
-			if(filename[0] == '/') {
+	while(count < MAX_SHADERS && fgets(line, sizeof(line), fd)) {
+		struct shader *shader = &list[count];
+		enum e_transition transition = FADE;
+		char duration[sizeof(line)] = "", filename[sizeof(line)];
+		char name[sizeof(line)], mask[sizeof(line)];
+		int fields = sscanf(line, "%s %s %s %s", duration, filename, name, mask);
+		char *end;
+		/* Frames with an f, otherwise milliseconds */
+		double value = strtod(duration, &end);
+		if(fields >= 2 && end != duration && (!*end || !strcmp(end, "f"))) {
+			int frames = *end ? value : value * 1e6 / frame_period_ns + 0.5;
+			int effect;
+			if(fields >= 3) {
+				if(!strcmp(name, "crossfade")) {
+					transition = CROSSFADE;
+				} else if(!strcmp(name, "wipe")) {
+					transition = WIPE;
+				} else if(!strcmp(name, "mask") && fields == 4) {
+					transition = MASK;
+				} else if(strcmp(name, "fade")) {
+					fprintf(stderr, "unknown transition: %s\n", name);
+					fclose(fd);
+					return -1;
+				}
+			}
+			memset(shader, 0, sizeof(*shader));
+			shader->type = REAL_SHADER;
+			if(filename[0] == '@') {
+				/* Effects drawn on the CPU, see effects.c */
+				if((effect = find_effect(filename+1)) == -1) {
+					fprintf(stderr, "unknown effect: %s\n", filename+1);
+					fclose(fd);
+					return -1;
+				}
+				shader->prog = effect;
+				shader->type = CPU_EFFECT;
+			} else if(!use_gl) {
+				fprintf(stderr, "skipping %s without OpenGL\n", filename);
+				continue;
+			} else if(filename[0] == '/') {
 				/* Special hack to address some internal GL routines */
-				prog = atoi(filename+1);
-				type = GL_CODE;
-			} else if(!(prog = setup_shader(filename))) {
-				ret = -1;
-				break;
+				shader->prog = atoi(filename+1);
+				shader->type = GL_CODE;
+			} else {
+				/* Take over the program from the old playlist */
+				for(i = 0; i < shader_count; i++) {
+					if(shaders[i].type == REAL_SHADER &&
+					   !strcmp(shaders[i].filename, filename) &&
+					   (shaders[i].prog || shaders[i].next)) {
+						*shader = shaders[i];
+						shaders[i].prog = shaders[i].next = 0;
+						break;
+					}
+				}
 			}
-			shaders[shader_count].time = time;
-			shaders[shader_count].prog = prog;
-			shaders[shader_count].type = type;
-			shader_count++;
+			shader->frames = frames > 0 ? frames : 1;
+			strcpy(shader->filename, filename);
+			shader->transition = transition;
+			if(transition == MASK) {
+				strcpy(shader->mask, mask);
+			}
+			count++;
 		}
 	}
 
 	fclose(fd);
 
-	if(!shader_count) {
-		ret = -1;
+	if(!count) {
+		return -1;
 	}
 
-	return ret;
+	for(i = 0; i < shader_count; i++) {
+		if(shaders[i].type == REAL_SHADER) {
+			if(shaders[i].prog) {
+				glDeleteObjectARB(shaders[i].prog);
+			}
+			if(shaders[i].next) {
+				glDeleteObjectARB(shaders[i].next);
+			}
+		}
+	}
+
+	/* Go on with the same shader if it is still there */
+	for(i = 0; i < count; i++) {
+		if(shader_count && !strcmp(list[i].filename, shaders[current_shader].filename)) {
+			break;
+		}
+	}
+	if(i == count) {
+		i = 0;
+		shader_activated_frame = frame_number;
+		transition_offset_x = 0;
+		transition_direction = 0;
+	}
+	current_shader = i;
+	next_shader = -1;
+
+	memcpy(shaders, list, count * sizeof(*list));
+	shader_count = count;
+
+	return 0;
+}
+
+/* Looked up once, rather than by name every frame */
+static void find_uniforms(struct shader *shader) {
+	unsigned int prog = shader->prog;
+
+	shader->uniforms.global_time = glGetUniformLocationARB(prog, "iGlobalTime");
+	shader->uniforms.resolution = glGetUniformLocationARB(prog, "iResolution");
+	shader->uniforms.frame = glGetUniformLocationARB(prog, "iFrame");
+	shader->uniforms.time_delta = glGetUniformLocationARB(prog, "iTimeDelta");
+	shader->uniforms.local_time = glGetUniformLocationARB(prog, "iLocalTime");
+	shader->uniforms.transition = glGetUniformLocationARB(prog, "iTransition");
+}
+
+static void finish_building(struct shader *shader) {
+	if(shader->next && !finish_shader(shader->next)) {
+		if(shader->prog) {
+			glDeleteObjectARB(shader->prog);
+		}
+		shader->prog = shader->next;
+		find_uniforms(shader);
+	} else if(!shader->prog) {
+		shader->broken = 1;
+	}
+	shader->next = 0;
+}
+
+/*
+  Builds one program at a time in the background, called between frames.
+  A program which is done replaces the old one before the next frame, or
+  if it failed to build the old one stays
+*/
+void build_shaders(void) {
+	static int reported;
+	struct shader *shader;
+	int cached, compiled, i;
+
+	for(i = 0; i < shader_count; i++) {
+		shader = &shaders[i];
+		if(shader->next) {
+			if(!shader_done(shader->next)) {
+				return;
+			}
+			finish_building(shader);
+			break;
+		}
+	}
+
+	for(i = 0; i < shader_count; i++) {
+		shader = &shaders[i];
+		if(shader->type == REAL_SHADER &&
+		   (shader->stale || (!shader->prog && !shader->broken))) {
+			shader->stale = 0;
+			if(!(shader->next = start_shader(shader->filename)) && !shader->prog) {
+				shader->broken = 1;
+			}
+			return;
+		}
+	}
+
+	if(!reported) {
+		shader_stats(&cached, &compiled);
+		fprintf(stderr, "all shaders built after %lu ms, %d from the cache and %d compiled\n",
+			get_msec(), cached, compiled);
+		reported = 1;
+	}
+}
+
+/* The program to draw the shader with, waiting for it if it is not built yet */
+unsigned int shader_program(struct shader *shader) {
+	if(!shader->prog && !shader->broken) {
+		if(!shader->next) {
+			shader->next = start_shader(shader->filename);
+		}
+		finish_building(shader);
+	}
+	return shader->prog;
+}
+
+/*
+  Watches the directory rather than the files, as editors tend to write a
+  new file and rename it over the old one
+*/
+static void init_watch(void) {
+	if((watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+	   inotify_add_watch(watch_fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		perror("failed to watch the shaders for changes");
+	}
+}
+
+void check_watch(void) {
+	char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	int reload = 0, i;
+	ssize_t length;
+	char *p;
+
+	if(watch_fd < 0) {
+		return;
+	}
+
+	while((length = read(watch_fd, buffer, sizeof(buffer))) > 0) {
+		for(p = buffer; p < buffer + length; p += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *)p;
+			if(!event->len) {
+				continue;
+			}
+			if(!strcmp(event->name, SHADERS_FILE)) {
+				reload = 1;
+			}
+			for(i = 0; i < shader_count; i++) {
+				if(shaders[i].type == REAL_SHADER &&
+				   !strcmp(shaders[i].filename, event->name)) {
+					shaders[i].stale = 1;
+					shaders[i].broken = 0;
+				}
+			}
+			/* Masks are simply built again when next used */
+			for(i = 0; i < mask_count; i++) {
+				if(!strcmp(masks[i].filename, event->name)) {
+					if(masks[i].prog) {
+						glDeleteObjectARB(masks[i].prog);
+					}
+					masks[i].prog = 0;
+					masks[i].broken = 0;
+				}
+			}
+		}
+	}
+
+	if(reload && read_shaders(SHADERS_FILE)) {
+		fprintf(stderr, "keeping the old playlist, %s is broken\n", SHADERS_FILE);
+	}
 }
@@ -0,0 +1,8 @@
+/* Mask for the mask transition, coming in from the middle out */
+uniform vec3 iResolution;
+
+void main(void)
+{
+  vec2 c = gl_FragCoord.xy - iResolution.xy * 0.5;
+  gl_FragColor = vec4(vec3(length(c) / length(iResolution.xy * 0.5)), 1.0);
+}
@@ -5,16 +5,34 @@
 #include <windows.h>
 #endif	/* __unix__ */
 
+#include <sys/stat.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <GL/gl.h>
 
-static int load_shader(const char *fname, GLenum type) {
+/*
+  Linked programs are kept in a cache directory, named by a hash of their
+  source and the driver, so the next start loads them without compiling.
+  A program which does not load, e.g. after a driver update changed
+  nothing in the strings hashed, is simply compiled again
+*/
+#define CACHE_DIR "raadhus_shader"
+/* Programs being built which go into the cache once they are linked */
+#define MAX_PENDING 8
+
+static struct {
+	unsigned int prog;
+	unsigned long long key;
+} pending[MAX_PENDING];
+
+static int cached_count, compiled_count;
+
+static char *read_source(const char *fname) {
 	FILE *fp;
-	GLhandleARB sdr;
 	unsigned int len;
 	char *src_buf;
-	int success;
 
 	if(!(fp = fopen(fname, "r"))) {
 		fprintf(stderr, "failed to open shader: %s\n", fname);
@@ -23,16 +41,33 @@ static int load_shader(const char *fname, GLenum type) {
 	fseek(fp, 0, SEEK_END);
 	len = ftell(fp);
 	fseek(fp, 0, SEEK_SET);
-	src_buf = malloc(len + 1);
+	if(!(src_buf = malloc(len + 1))) {
+		perror("malloc failed");
+		fclose(fp);
+		return 0;
+	}
 
 	fread(src_buf, 1, len, fp);
 	src_buf[len] = 0;
+	fclose(fp);
 
-	sdr = glCreateShaderObjectARB(type);
-	glShaderSourceARB(sdr, 1, (const char**)&src_buf, 0);
-	free(src_buf);
+	return src_buf;
+}
+
+/* Starts compiling the shader without waiting for it, see check_shader */
+static int compile_shader(const char *src_buf, GLenum type) {
+	GLhandleARB sdr;
 
+	sdr = glCreateShaderObjectARB(type);
+	glShaderSourceARB(sdr, 1, &src_buf, 0);
 	glCompileShaderARB(sdr);
+
+	return sdr;
+}
+
+static int check_shader(GLhandleARB sdr) {
+	int success;
+
 	glGetObjectParameterivARB(sdr, GL_OBJECT_COMPILE_STATUS_ARB, &success);
 	if(!success) {
 		int info_len;
@@ -53,25 +88,265 @@ static int load_shader(const char *fname, GLenum type) {
 		return 0;
 	}
 
+	return 1;
+}
+
+static int load_shader(const char *fname, GLenum type) {
+	GLhandleARB sdr;
+	char *src_buf;
+
+	if(!(src_buf = read_source(fname))) {
+		return 0;
+	}
+	sdr = compile_shader(src_buf, type);
+	free(src_buf);
+
+	if(!check_shader(sdr)) {
+		return 0;
+	}
 	return sdr;
 }
 
-unsigned int setup_shader(const char *fname) {
+static int has_extension(const char *name) {
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+
+	return extensions && strstr(extensions, name);
+}
+
+static int binary_cache(void) {
+	static int supported = -1;
+	int formats = 0;
+
+	if(supported < 0) {
+		if(has_extension("GL_ARB_get_program_binary")) {
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		}
+		supported = formats > 0;
+	}
+
+	return supported;
+}
+
+static unsigned long long hash_string(unsigned long long hash, const char *s) {
+	/* FNV-1a */
+	while(s && *s) {
+		hash ^= (unsigned char)*s++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static unsigned long long cache_key(const char *src_buf) {
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+
+	hash = hash_string(hash, (const char *)glGetString(GL_VENDOR));
+	hash = hash_string(hash, (const char *)glGetString(GL_RENDERER));
+	hash = hash_string(hash, (const char *)glGetString(GL_VERSION));
+	return hash_string(hash, src_buf);
+}
+
+/* $XDG_CACHE_HOME/raadhus_shader or ~/.cache/raadhus_shader */
+static int cache_dir(char *path, size_t size, int create) {
+	const char *base = getenv("XDG_CACHE_HOME");
+
+	if(base && *base) {
+		snprintf(path, size, "%s", base);
+	} else if((base = getenv("HOME"))) {
+		snprintf(path, size, "%s/.cache", base);
+	} else {
+		return -1;
+	}
+	if(create) {
+		mkdir(path, 0755);
+	}
+
+	strncat(path, "/" CACHE_DIR, size - strlen(path) - 1);
+	if(create && mkdir(path, 0755) < 0 && errno != EEXIST) {
+		return -1;
+	}
+	return 0;
+}
+
+static int load_cached(unsigned int prog, unsigned long long key) {
+	char path[512];
+	FILE *fp;
+	GLenum format;
+	long len;
+	void *binary;
+	int linked = 0;
+
+	if(cache_dir(path, sizeof(path), 0) < 0) {
+		return -1;
+	}
+	snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%016llx", key);
+	if(!(fp = fopen(path, "rb"))) {
+		return -1;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp) - (long)sizeof(format);
+	fseek(fp, 0, SEEK_SET);
+	if(len > 0 && (binary = malloc(len))) {
+		if(fread(&format, sizeof(format), 1, fp) == 1 &&
+		   fread(binary, 1, len, fp) == len) {
+			glProgramBinary(prog, format, binary, len);
+			glGetProgramiv(prog, GL_LINK_STATUS, &linked);
+		}
+		free(binary);
+	}
+	fclose(fp);
+
+	return linked ? 0 : -1;
+}
+
+static void save_cached(unsigned int prog, unsigned long long key) {
+	char path[512], tmp[520];
+	FILE *fp;
+	GLenum format;
+	GLint len = 0;
+	void *binary;
+
+	glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &len);
+	if(len <= 0 || cache_dir(path, sizeof(path), 1) < 0 || !(binary = malloc(len))) {
+		return;
+	}
+	glGetProgramBinary(prog, len, &len, &format, binary);
+
+	/* Written aside and renamed, so another instance never loads half a program */
+	snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%016llx", key);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if((fp = fopen(tmp, "wb"))) {
+		if(fwrite(&format, sizeof(format), 1, fp) == 1 &&
+		   fwrite(binary, 1, len, fp) == len && !fclose(fp)) {
+			rename(tmp, path);
+		} else {
+			remove(tmp);
+		}
+	}
+	free(binary);
+}
+
+static void forget_pending(unsigned int prog) {
+	int i;
+
+	for(i = 0; i < MAX_PENDING; i++) {
+		if(pending[i].prog == prog) {
+			pending[i].prog = 0;
+		}
+	}
+}
+
+static void remember_pending(unsigned int prog, unsigned long long key) {
+	int i;
+
+	for(i = 0; i < MAX_PENDING; i++) {
+		if(!pending[i].prog) {
+			pending[i].prog = prog;
+			pending[i].key = key;
+			return;
+		}
+	}
+}
+
+/*
+  Starts building a program of the fragment shader in fname without
+  waiting for the compiler. With GL_ARB_parallel_shader_compile it runs
+  in the driver's own threads until shader_done says it is finished,
+  otherwise finish_shader waits for it. Programs in the cache are ready
+  right away
+*/
+unsigned int start_shader(const char *fname) {
 	unsigned int prog, sdr;
-	int linked;
+	unsigned long long key = 0;
+	char *src_buf;
 
-	sdr = load_shader(fname, GL_FRAGMENT_SHADER_ARB);
-	if(!sdr) {
-		fprintf(stderr, "shader loading failed\n");
+	if(!(src_buf = read_source(fname))) {
 		return 0;
 	}
 
 	prog = glCreateProgramObjectARB();
+	/* A program of the same name may have been deleted while building */
+	forget_pending(prog);
+	if(binary_cache()) {
+		key = cache_key(src_buf);
+		if(!load_cached(prog, key)) {
+			free(src_buf);
+			cached_count++;
+			return prog;
+		}
+		/* Start over, the failed binary leaves it unusable */
+		glDeleteObjectARB(prog);
+		prog = glCreateProgramObjectARB();
+		forget_pending(prog);
+		glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		remember_pending(prog, key);
+	}
+
+	sdr = compile_shader(src_buf, GL_FRAGMENT_SHADER_ARB);
+	free(src_buf);
+	compiled_count++;
+
 	glAttachObjectARB(prog, sdr);
+	/* Goes with the program */
+	glDeleteObjectARB(sdr);
 	glLinkProgramARB(prog);
+
+	return prog;
+}
+
+int shader_done(unsigned int prog) {
+	static int parallel = -1;
+	int done = 1;
+
+	if(parallel < 0) {
+		parallel = has_extension("GL_ARB_parallel_shader_compile") ||
+			has_extension("GL_KHR_parallel_shader_compile");
+	}
+	if(parallel) {
+		glGetProgramiv(prog, GL_COMPLETION_STATUS_ARB, &done);
+	}
+
+	return done;
+}
+
+/* Returns 0 if the program is ready to use, otherwise it is deleted */
+int finish_shader(unsigned int prog) {
+	GLhandleARB sdr;
+	int linked, count;
+
 	glGetObjectParameterivARB(prog, GL_OBJECT_LINK_STATUS_ARB, &linked);
 	if(!linked) {
-		fprintf(stderr, "shader linking failed\n");
+		/* Most likely the shader did not compile, which tells why */
+		glGetAttachedObjectsARB(prog, 1, &count, &sdr);
+		if(!count || check_shader(sdr)) {
+			fprintf(stderr, "shader linking failed\n");
+		}
+		forget_pending(prog);
+		glDeleteObjectARB(prog);
+		return -1;
+	}
+
+	for(count = 0; count < MAX_PENDING; count++) {
+		if(pending[count].prog == prog) {
+			save_cached(prog, pending[count].key);
+			pending[count].prog = 0;
+		}
+	}
+
+	return 0;
+}
+
+/* How many programs were loaded from the cache and how many compiled */
+void shader_stats(int *cached, int *compiled) {
+	*cached = cached_count;
+	*compiled = compiled_count;
+}
+
+unsigned int setup_shader(const char *fname) {
+	unsigned int prog = start_shader(fname);
+
+	if(!prog || finish_shader(prog)) {
+		fprintf(stderr, "shader loading failed\n");
 		return 0;
 	}
 
@@ -134,15 +409,19 @@ void set_shader(unsigned int prog) {
 
 unsigned long get_msec(void) {
 #if defined(__unix__) || defined(unix)
-	static struct timeval timeval, first_timeval;
-	
-	gettimeofday(&timeval, 0);
+	/* Monotonic, so it never jumps when the clock is set */
+	static struct timespec start;
+	static int started;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	if(first_timeval.tv_sec == 0) {
-		first_timeval = timeval;
+	if(!started) {
+		start = now;
+		started = 1;
 		return 0;
 	}
-	return (timeval.tv_sec - first_timeval.tv_sec) * 1000 + (timeval.tv_usec - first_timeval.tv_usec) / 1000;
+	return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
 #else
 	return GetTickCount();
 #endif	/* __unix__ */